@@ -67,7 +67,7 @@ public:
     // Writes the given number of samples from the given buffer to the wav
     // file. The buffer should be at least the size of nsamples * channels.
     //
-    void write(float buf[], std::size_t nsamples);
+    void write(float const buf[], std::size_t nsamples);
 
 private:
 
@@ -214,7 +214,7 @@ Wav::~Wav() {
     mStream.write(reinterpret_cast<const char *>(&dataChunkSize), sizeof(dataChunkSize));
 }
 
-void Wav::write(float buf[], std::size_t nsamples) {
+void Wav::write(float const buf[], std::size_t nsamples) {
 
     std::size_t totalSamples = mChannels * nsamples;
     mStream.write(reinterpret_cast<const char*>(buf), totalSamples * sizeof(float));
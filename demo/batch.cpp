@@ -0,0 +1,91 @@
+//
+// Batch rendering demo. Renders a number of random songs (the same kind of
+// song as the random demo) in parallel using the gbapu_render library, each
+// song is written to its own wav file. Then a single long song is rendered
+// using segment-parallel rendering, and written as a 16-bit wav file.
+//
+
+#include "gbapu_render.hpp"
+
+#include <iostream>
+#include <random>
+#include <string>
+
+using namespace gbapu;
+
+constexpr unsigned SAMPLERATE = 48000;
+constexpr size_t SONGS = 16;
+constexpr size_t FRAMES = 60 * 4;
+constexpr size_t LONG_FRAMES = 60 * 60 * 5;
+
+//
+// Generates a script similar to the one in random.cpp, using the given seed
+//
+static std::vector<RegisterWrite> randomScript(unsigned seed, size_t frames) {
+    std::minstd_rand rng(seed);
+    std::vector<RegisterWrite> script;
+
+    for (size_t frame = 0; frame < frames; frame += 12) {
+        uint64_t time = frame * Renderer::CYCLES_PER_FRAME;
+        auto add = [&](uint8_t reg, uint8_t value) {
+            script.push_back({ time, reg, value });
+            time += 12;
+        };
+
+        uint8_t terms = rng() & 0x11;
+        if (terms == 0) {
+            terms = 0x11;
+        }
+        add(Apu::REG_NR52, 0x80);
+        add(Apu::REG_NR50, 0x77);
+        add(Apu::REG_NR51, terms);
+        add(Apu::REG_NR10, 0x70 + (rng() & 0xF));
+        add(Apu::REG_NR11, 0x80);
+        add(Apu::REG_NR12, 0xF1);
+        uint16_t freq = (rng() & 0x4FF) + 0x300;
+        add(Apu::REG_NR13, freq & 0xFF);
+        add(Apu::REG_NR14, (freq >> 8) | 0x80);
+    }
+
+    return script;
+}
+
+static void printStats(RenderStats const& stats) {
+    std::cout << " * Total elapsed time: "
+        << std::chrono::duration_cast<std::chrono::milliseconds>(stats.elapsed).count()
+        << " ms" << std::endl;
+    std::cout << " * Samples generated: " << stats.samples << std::endl;
+    std::cout << " * Samples per second: " << stats.samplesPerSecond() << std::endl;
+    std::cout << " * Ratio: " << stats.ratio() << std::endl;
+}
+
+int main() {
+
+    std::vector<std::unique_ptr<AudioWriter>> wavs;
+    std::vector<RenderJob> jobs;
+    for (size_t i = 0; i != SONGS; ++i) {
+        auto &wav = wavs.emplace_back(std::make_unique<AudioWriter>(
+            "batch_" + std::to_string(i) + ".wav", SAMPLERATE
+        ));
+        jobs.push_back({
+            randomScript((unsigned)i + 1, FRAMES),
+            FRAMES * Renderer::CYCLES_PER_FRAME,
+            wav->sink()
+        });
+    }
+
+    Renderer renderer(SAMPLERATE);
+    std::cout << "Rendering " << SONGS << " songs on " << renderer.threads()
+              << " thread(s)" << std::endl;
+    printStats(renderer.render(jobs));
+
+    std::cout << "Rendering a " << LONG_FRAMES / 60 / 60 << " minute song in segments" << std::endl;
+    AudioWriter longWav("batch_long.wav", SAMPLERATE, 2, SampleFormat::s16);
+    printStats(renderer.renderSegmented({
+        randomScript(0, LONG_FRAMES),
+        LONG_FRAMES * Renderer::CYCLES_PER_FRAME,
+        longWav.sink()
+    }));
+
+    return 0;
+}
@@ -1,7 +1,7 @@
 //
 // Simple benchmark program. Benchmark does a stress test on the APU, all
 // channels outputting at maximum frequency. The test is run once for all
-// possible quality setings.
+// possible quality setings, and for each kernel format.
 //
 
 #include "gbapu.hpp"
@@ -100,6 +100,8 @@ void doBenchmark(gbapu::Apu &apu, BenchmarkResults &results) {
     for (size_t i = 0; i < FRAMES_PER_BENCHMARK; ++i) {
         auto startTime = Clock::now();
         apu.step(CYCLES_PER_FRAME);
+        // oversampled synthesis decimates at the end of the frame
+        apu.endFrame();
         auto frameTime = Clock::now() - startTime;
         if (frameTime < results.minimum) {
             results.minimum = frameTime;
@@ -108,7 +110,6 @@ void doBenchmark(gbapu::Apu &apu, BenchmarkResults &results) {
             results.maximum = frameTime;
         }
         results.elapsed += frameTime;
-        apu.endFrame();
         apu.clearSamples();
     }
 
@@ -117,12 +118,69 @@ void doBenchmark(gbapu::Apu &apu, BenchmarkResults &results) {
 }
 
 
+struct KernelFormatTest {
+    char const* name;
+    gbapu::KernelFormat format;
+};
+
+constexpr KernelFormatTest KERNEL_FORMATS[] = {
+    { "full", gbapu::KernelFormat::full },
+    { "symmetric", gbapu::KernelFormat::symmetric },
+    { "fine", gbapu::KernelFormat::fine }
+};
+
+struct SynthesisTest {
+    char const* name;
+    gbapu::Synthesis synthesis;
+};
+
+// blep is tested above
+constexpr SynthesisTest SYNTHESES[] = {
+    { "linear", gbapu::Synthesis::linear },
+    { "nearest", gbapu::Synthesis::nearest },
+    { "oversampled", gbapu::Synthesis::oversampled }
+};
+
+// kernel widths to test, 0 for the default kernel
+constexpr size_t KERNEL_WIDTHS[] = { 0, 32 };
+
+
 int main() {
 
     gbapu::Apu apu(SAMPLERATE, SAMPLERATE / 10);
     BenchmarkResults results;
 
     std::cout << "Synthesizing " << FRAMES_PER_BENCHMARK << " frames per test" << std::endl;
+    for (auto width : KERNEL_WIDTHS) {
+        apu.setKernel(width);
+        for (auto const& test : KERNEL_FORMATS) {
+            apu.setKernelFormat(test.format);
+            std::cout << "Kernel width " << (width ? width : 16) << ", " << test.name << " format" << std::endl;
+            doBenchmark(apu, results);
+            printResults(results);
+        }
+    }
+
+    apu.setKernel(0);
+    apu.setKernelFormat(gbapu::KernelFormat::full);
+
+    for (auto const& test : SYNTHESES) {
+        apu.setSynthesis(test.synthesis);
+        std::cout << "Kernel width 16, full format, " << test.name << " synthesis" << std::endl;
+        doBenchmark(apu, results);
+        printResults(results);
+    }
+
+    apu.setSynthesis(gbapu::Synthesis::blep);
+    apu.setMono(true);
+    std::cout << "Kernel width 16, full format, mono" << std::endl;
+    doBenchmark(apu, results);
+    printResults(results);
+    apu.setMono(false);
+
+    // the ratio is of emulated time, the audio generated is 4 times shorter
+    apu.setTurbo(4);
+    std::cout << "Kernel width 16, full format, turbo 4x" << std::endl;
     doBenchmark(apu, results);
     printResults(results);
 
@@ -2,12 +2,19 @@
 #ifndef GBAPU_HPP
 #define GBAPU_HPP
 
+#include <algorithm>
 #include <array>
 #include <cstdint>
 #include <cstddef>
+#include <functional>
 #include <memory>
+#include <new>
 #include <tuple>
+#include <type_traits>
 #include <optional>
+#include <utility>
+#include <variant>
+#include <vector>
 
 namespace gbapu {
 
@@ -24,6 +31,126 @@ constexpr T CLOCK_SPEED = T(4194304);
 
 } // constants
 
+//
+// Storage format of a step kernel in a mixer. The formats trade memory (and
+// cache footprint) for arithmetic. Full and symmetric have the same output,
+// fine rounds each step to the nearest 1/256th of a sample.
+//
+enum class KernelFormat {
+    full,       // (phases + 1) step sets, two sets are interpolated per step
+    symmetric,  // only the first half of each set, the second half is read
+                // in reverse from the mirrored phase. Half the size of full.
+    fine        // 256 pre-interpolated step sets, the nearest one is used
+                // without interpolation. About 256 / phases times the size
+                // of full.
+};
+
+//
+// How changes in a channel's output are synthesized to samples
+//
+enum class Synthesis {
+    blep,       // bandlimited steps, using the mixer's step kernel (default)
+    linear,     // each step is linearly interpolated between two samples
+    nearest,    // each step is added to the nearest sample, aliases the most
+    oversampled // steps are box filtered into bins of 32 cycles, and the bins
+                // are decimated with the step kernel at the end of the frame
+};
+
+//
+// Size of a cache line, the default alignment of buffers
+//
+constexpr size_t CACHE_LINE_SIZE = 64;
+
+//
+// Size of a huge page (x86-64 and ARM64 with 4K pages). Buffers of at least
+// this size are aligned to it.
+//
+constexpr size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+//
+// Interface for allocating the buffers of an Apu and its mixers. Buffers
+// are only allocated when the Apu is constructed or configured, see
+// Apu::Apu(unsigned, size_t, Allocator&) for what never allocates.
+//
+class Allocator {
+
+public:
+    virtual ~Allocator() = default;
+
+    //
+    // Allocates the given number of bytes, aligned to at least the given
+    // alignment (a power of two). Throws std::bad_alloc on failure.
+    //
+    virtual void* allocate(size_t bytes, size_t alignment) = 0;
+
+    //
+    // Frees memory from allocate, bytes and alignment are the same as they
+    // were when allocated.
+    //
+    virtual void deallocate(void *ptr, size_t bytes, size_t alignment) noexcept = 0;
+
+};
+
+//
+// Allocates with the aligned operator new, aligning every allocation to at
+// least the given alignment. On Linux, allocations aligned to HUGE_PAGE_SIZE
+// are advised to be backed by transparent huge pages.
+//
+class AlignedAllocator : public Allocator {
+
+public:
+    explicit AlignedAllocator(size_t alignment = CACHE_LINE_SIZE) noexcept;
+
+    void* allocate(size_t bytes, size_t alignment) override;
+
+    void deallocate(void *ptr, size_t bytes, size_t alignment) noexcept override;
+
+private:
+    size_t mAlignment;
+
+};
+
+//
+// Allocates from a fixed block of memory by bumping a pointer. Memory is
+// only reclaimed by release(), which must not be called while anything
+// allocated from the arena is in use. Throws std::bad_alloc when the arena
+// is full.
+//
+class ArenaAllocator : public Allocator {
+
+public:
+    //
+    // Uses the given memory, which must outlive the arena
+    //
+    ArenaAllocator(void *memory, size_t size) noexcept;
+
+    void* allocate(size_t bytes, size_t alignment) override;
+
+    void deallocate(void *ptr, size_t bytes, size_t alignment) noexcept override;
+
+    //
+    // Frees everything allocated from the arena
+    //
+    void release() noexcept;
+
+    //
+    // Number of bytes used so far, including padding for alignment
+    //
+    size_t used() const noexcept;
+
+private:
+    char *mMemory;
+    size_t mSize;
+    size_t mUsed;
+
+};
+
+//
+// The allocator used when none is given, an AlignedAllocator aligning to
+// CACHE_LINE_SIZE
+//
+Allocator& defaultAllocator() noexcept;
+
 namespace _internal {
 
 
@@ -52,34 +179,258 @@ constexpr bool modePansRight(MixMode mode) {
 
 using ChannelMix = std::array<MixMode, 4>;
 
+//
+// Volume steps that a source's changes in output are mixed with
+//
+struct VolumeStep {
+    float left = 0.0f;
+    float right = 0.0f;
+    // folded volume step for each MixMode, for mono
+    std::array<float, 4> mono = {};
+
+    VolumeStep() = default;
+
+    VolumeStep(float leftVolume, float rightVolume) noexcept;
+};
+
+//
+// Array of zero-initialized trivial values, allocated with an Allocator
+//
+template <typename T>
+class Buffer {
+
+    static_assert(std::is_trivial_v<T>, "buffer elements must be trivial");
+
+public:
+    explicit Buffer(Allocator &allocator = defaultAllocator()) noexcept :
+        mAllocator(&allocator),
+        mData(nullptr),
+        mSize(0)
+    {
+    }
+
+    Buffer(Buffer &&other) noexcept :
+        mAllocator(other.mAllocator),
+        mData(std::exchange(other.mData, nullptr)),
+        mSize(std::exchange(other.mSize, 0))
+    {
+    }
+
+    Buffer& operator=(Buffer &&other) noexcept {
+        if (this != &other) {
+            reset();
+            mAllocator = other.mAllocator;
+            mData = std::exchange(other.mData, nullptr);
+            mSize = std::exchange(other.mSize, 0);
+        }
+        return *this;
+    }
+
+    ~Buffer() {
+        reset();
+    }
+
+    //
+    // Replaces the contents with size zeros
+    //
+    void allocate(size_t size) {
+        reset();
+        if (size) {
+            mData = static_cast<T*>(mAllocator->allocate(size * sizeof(T), alignment(size)));
+            std::fill_n(mData, size, T{});
+            mSize = size;
+        }
+    }
+
+    void reset() noexcept {
+        if (mData) {
+            mAllocator->deallocate(mData, mSize * sizeof(T), alignment(mSize));
+            mData = nullptr;
+            mSize = 0;
+        }
+    }
+
+    Allocator& allocator() const noexcept {
+        return *mAllocator;
+    }
+
+    T* get() const noexcept {
+        return mData;
+    }
+
+    size_t size() const noexcept {
+        return mSize;
+    }
+
+    explicit operator bool() const noexcept {
+        return mData != nullptr;
+    }
+
+private:
+    //
+    // Buffers are aligned to a cache line, or to a huge page once they span
+    // one, so that the allocator can back them with huge pages
+    //
+    static constexpr size_t alignment(size_t size) noexcept {
+        return std::max(
+            size * sizeof(T) >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : CACHE_LINE_SIZE,
+            alignof(T)
+        );
+    }
+
+    Allocator *mAllocator;
+    T *mData;
+    size_t mSize;
+
+};
+
+//
+// Destroys an object made with makeAllocated and frees it with the
+// allocator it was allocated with
+//
+template <typename T>
+class AllocatedDelete {
+
+public:
+    explicit AllocatedDelete(Allocator &allocator = defaultAllocator()) noexcept :
+        mAllocator(&allocator)
+    {
+    }
+
+    void operator()(T *ptr) const noexcept {
+        ptr->~T();
+        mAllocator->deallocate(ptr, sizeof(T), alignment());
+    }
+
+    static constexpr size_t alignment() noexcept {
+        return std::max(CACHE_LINE_SIZE, alignof(T));
+    }
+
+private:
+    Allocator *mAllocator;
+
+};
+
+template <typename T>
+using Allocated = std::unique_ptr<T, AllocatedDelete<T>>;
+
+//
+// Constructs an object in memory from the given allocator
+//
+template <typename T, typename... Args>
+Allocated<T> makeAllocated(Allocator &allocator, Args&&... args) {
+    AllocatedDelete<T> deleter(allocator);
+    auto memory = allocator.allocate(sizeof(T), deleter.alignment());
+    try {
+        return Allocated<T>(new (memory) T(std::forward<Args>(args)...), deleter);
+    } catch (...) {
+        allocator.deallocate(memory, sizeof(T), deleter.alignment());
+        throw;
+    }
+}
+
+//
+// Adapts an Allocator for the standard containers
+//
+template <typename T>
+class ContainerAllocator {
+
+public:
+    using value_type = T;
+
+    explicit ContainerAllocator(Allocator &allocator = defaultAllocator()) noexcept :
+        mAllocator(&allocator)
+    {
+    }
+
+    template <typename U>
+    ContainerAllocator(ContainerAllocator<U> const& other) noexcept :
+        mAllocator(&other.allocator())
+    {
+    }
+
+    T* allocate(size_t n) {
+        return static_cast<T*>(mAllocator->allocate(n * sizeof(T), alignof(T)));
+    }
+
+    void deallocate(T *ptr, size_t n) noexcept {
+        mAllocator->deallocate(ptr, n * sizeof(T), alignof(T));
+    }
+
+    Allocator& allocator() const noexcept {
+        return *mAllocator;
+    }
+
+    template <typename U>
+    bool operator==(ContainerAllocator<U> const& other) const noexcept {
+        return mAllocator == &other.allocator();
+    }
+
+    template <typename U>
+    bool operator!=(ContainerAllocator<U> const& other) const noexcept {
+        return mAllocator != &other.allocator();
+    }
+
+private:
+    Allocator *mAllocator;
+
+};
+
 class Mixer {
 
 public:
-    explicit Mixer();
+    //
+    // Creates a mixer that allocates its buffers with the given allocator,
+    // which must outlive the mixer
+    //
+    explicit Mixer(Allocator &allocator = defaultAllocator());
 
     //
-    // Mixes a bandlimited step with the given delta (-15 to 15). The delta
-    // is multiplied by the volume step for its destination terminal.
-    // Calling this function with MixMode::mute does nothing.
+    // Mixes a bandlimited step with the given delta (-15 to 15) for the
+    // given channel. The delta is multiplied by the source's volume step for
+    // its destination terminal, so that several sources can mix into one
+    // mixer with their own volume. Calling this function with MixMode::mute
+    // does nothing. The channel only matters when stems are enabled, it
+    // selects the stem buffer to mix to.
     //
-    void mix(MixMode mode, int8_t delta, uint32_t cycletime);
+    void mix(size_t channel, MixMode mode, int8_t delta, uint32_t cycletime, VolumeStep const& volume);
 
     //
-    // Adds DC offsets to each terminal at the given cycle time
+    // Adds DC offsets to each terminal at the given cycle time. With
+    // oversampled synthesis, the offsets are mixed through the bins like
+    // steps, so they have the same delay.
     //
-    void mixDc(float dcLeft, float dcRight, uint32_t cycletime);
+    void mixDc(size_t channel, float dcLeft, float dcRight, uint32_t cycletime);
 
     //
     // Same as mix, but has the mode as a template parameter
     //
     template <MixMode mode>
-    void mixfast(int8_t delta, uint32_t cycletime);
+    void mixfast(size_t channel, int8_t delta, uint32_t cycletime, VolumeStep const& volume);
+
+    //
+    // Same as mixfast, but has the synthesis as a template parameter. The
+    // synthesis must be the one set with setSynthesis.
+    //
+    template <MixMode mode, Synthesis synthesis>
+    void mixfast(size_t channel, int8_t delta, uint32_t cycletime, VolumeStep const& volume);
 
     //
-    // Sets the volume step for each terminal.
+    // Sets the next mixer in the chain. Everything mixed to this mixer (mix,
+    // mixfast and mixDc) is also mixed to the next one, so that a single
+    // hardware run can output to mixers of different samplerates. The next
+    // mixer must outlive this one, or be unset with nullptr.
+    //
+    void setNext(Mixer *next) noexcept;
+
+    //
+    // Sets the volume step for each terminal. The mixer only stores it for
+    // its owner, steps are mixed with the volume given to mix.
     //
     void setVolume(float leftVolume, float rightVolume);
 
+    VolumeStep const& volume() const noexcept;
+
     //
     // Volume step for the left terminal
     //
@@ -90,6 +441,17 @@ public:
     //
     float rightVolume() const noexcept;
 
+    //
+    // Enables or disables mono. When enabled, the left and right volume
+    // steps are folded into one volume step per mix mode, so that only one
+    // stream is mixed, integrated and filtered. Samples read are then one
+    // float each instead of an interleaved left and right. The buffer is
+    // cleared when the setting changes.
+    //
+    void setMono(bool enabled);
+
+    bool monoEnabled() const noexcept;
+
     // buffer management
 
     //
@@ -98,18 +460,152 @@ public:
     //
     void setBuffer(size_t samples);
 
+    //
+    // Grows the sample buffer to hold at least the given number of samples,
+    // keeping everything mixed so far. Does nothing if the buffer is
+    // already large enough.
+    //
+    void growBuffer(size_t samples);
+
+    //
+    // Frees the sample buffer and bins, for a mixer that is not mixed into.
+    // Must call setBuffer before mixing again.
+    //
+    void releaseBuffer();
+
+    //
+    // Gets the number of cycles past the given cycle time that can be mixed
+    // before the buffer is full. Mixing at a later time writes past the end
+    // of the buffer, nothing is checked when mixing.
+    //
+    uint32_t cyclesAvailable(uint32_t cycletime) const noexcept;
+
+    //
+    // Gets the buffer size, in samples, needed to mix up to the given cycle
+    // time
+    //
+    size_t samplesNeeded(uint32_t cycletime) const noexcept;
+
+    //
+    // Size of the sample buffer, in samples
+    //
+    size_t bufferSize() const noexcept;
+
     //
     // Sets the samplerate. This change will only effect new mixes, so
     // it's recommended to clear the buffer beforehand.
     //
     void setSamplerate(unsigned rate);
 
+    unsigned samplerate() const noexcept;
+
+    //
+    // Scales the number of samples per cycle by the given ratio, for
+    // dynamic rate control. The ratio takes effect at the next endFrame or
+    // flush, where the sample time restarts from the fractional offset, so
+    // nothing already mixed moves and the buffer and filter state are kept.
+    // The filter and kernel stay tuned to the nominal samplerate. A cleared
+    // mixer starts with the new ratio right away. Ratios that are not
+    // positive and finite are ignored.
+    //
+    void setRateRatio(double ratio);
+
+    double rateRatio() const noexcept;
+
+    //
+    // Sets a fixed frame period, in cycles, or 0 to disable. Every frame
+    // ended at exactly the given cycle time then yields exactly the given
+    // number of samples, or the samplerate's number of samples per frame
+    // rounded to the nearest if 0. Samples per cycle is the rational
+    // samples / cycles, which replaces the rate ratio, and the fractional
+    // offset is the same for every frame, so the count does not depend on
+    // float rounding. Frames of any other length are mixed as usual. Like
+    // the rate ratio, this takes effect at the next endFrame, flush or
+    // clear.
+    //
+    void setFramePeriod(uint32_t cycles, size_t samples = 0);
+
+    //
+    // Number of samples in a frame of the frame period, 0 when disabled
+    //
+    size_t samplesPerFrame() const noexcept;
+
+    //
+    // Enables or disables stems. When enabled, each channel is mixed into
+    // its own buffer so that the channels can be read separately with
+    // readStems. The buffer is cleared when the setting changes.
+    //
+    void setStems(bool enabled);
+
+    bool stemsEnabled() const noexcept;
+
+    //
+    // Sets the kernel used for the bandlimited steps. A width of 0 selects
+    // the default kernel (16 samples wide, 32 phases). Otherwise a
+    // windowed-sinc kernel is generated with the given width, rounded up to
+    // one of 8, 16 or 32 samples (wider is clamped to 32), and the given
+    // number of phases (0 for the default, 32). The
+    // kernel's cutoff is 20 kHz, or just under nyquist for samplerates under
+    // 44.1 kHz. Generated kernels are regenerated when the samplerate
+    // changes. The output is delayed by half of the kernel's width.
+    //
+    void setKernel(size_t width, size_t phases = 32);
+
+    //
+    // Maximum kernel width, in samples
+    //
+    static constexpr size_t MAX_KERNEL_WIDTH = 32;
+
+    //
+    // Sets the storage format of the kernel. The format's table is derived
+    // from the kernel set by setKernel, and is rebuilt when the kernel
+    // changes.
+    //
+    void setKernelFormat(KernelFormat format);
+
+    KernelFormat kernelFormat() const noexcept;
+
+    //
+    // Number of step sets in the fine kernel format
+    //
+    static constexpr size_t FINE_PHASES = 256;
+
+    //
+    // Sets the synthesis, see Synthesis. The buffer is cleared when the
+    // setting changes. Linear and nearest steps are delayed by the same
+    // amount as the kernel's steps, so all syntheses have about the same
+    // latency.
+    //
+    // With oversampled synthesis, changes are box filtered into bins of
+    // BIN_CYCLES cycles instead of mixing a bandlimited step for each
+    // change. At endFrame, the bins are decimated to the samplerate by
+    // mixing each bin with the step kernel. The cost of a frame is then
+    // bounded by the number of bins, no matter how often the channels
+    // change, at the cost of some extra attenuation near nyquist. The output
+    // is delayed by one more bin.
+    //
+    void setSynthesis(Synthesis synthesis);
+
+    Synthesis synthesis() const noexcept;
+
+    //
+    // Width of a bin, in cycles, for oversampled synthesis
+    //
+    static constexpr uint32_t BIN_CYCLES = 32;
+
     //
     // Ends the frame at the given cycle time, allowing for samples to be
     // read from the buffer
     //
     void endFrame(uint32_t cycletime);
 
+    //
+    // Same as endFrame, except that the frame continues: the samples up to
+    // the given cycle time can be read, and later cycle times are still
+    // relative to the start of the frame.
+    //
+    void flush(uint32_t cycletime);
+
     //
     // Gets the total number of samples available for reading
     //
@@ -121,6 +617,27 @@ public:
     //
     size_t readSamples(float buf[], size_t samples);
 
+    //
+    // Reads samples for each stem and the sum of all stems. Any of the
+    // destination buffers can be nullptr if that output is not needed. When
+    // stems are disabled, only buf is written to.
+    //
+    size_t readStems(float buf[], std::array<float*, 4> const& stems, size_t samples);
+
+    //
+    // Same as readSamples, but the samples are not integrated or filtered.
+    // Each sample read is the sum of the bandlimited steps mixed at that
+    // sample. Use integrate() to convert them to output samples. With stems
+    // enabled, the deltas of all stems are summed.
+    //
+    size_t readDeltas(float buf[], size_t samples);
+
+    //
+    // Integrates and high pass filters the given samples, in place, from
+    // readDeltas(). The filter state is continued from the last read.
+    //
+    void integrate(float buf[], size_t samples);
+
     //
     // Removes the given number of samples from the buffer
     //
@@ -131,6 +648,24 @@ public:
     //
     void clear();
 
+    //
+    // Returns true if nothing is mixed in the buffer and the filter has
+    // settled, every sample read will be under one 16-bit LSB (usually
+    // exactly 0) until something is mixed.
+    //
+    bool isIdle() const noexcept;
+
+    //
+    // Fractional sample time the next frame starts at
+    //
+    float sampleOffset() const noexcept;
+
+    //
+    // Sets the fractional sample time of the current frame, for resuming
+    // a frame sequence from a saved state. The offset must be in [0, 1).
+    //
+    void setSampleOffset(float offset) noexcept;
+
 private:
     //
     // Converts the time in cycles to time in samples
@@ -138,12 +673,10 @@ private:
     float sampletime(uint32_t cycletime) const noexcept;
 
     struct MixParam {
-        // the stepset to use
-        float const* stepset;
         // the destination in the buffer to mix the step
         float *dest;
-        // time fraction used for interpolation
-        float timeFract;
+        // fractional part of the sample time, used to select the stepset
+        float fract;
 
     };
 
@@ -158,29 +691,187 @@ private:
         void process(float *dest, float in, float highPassRate);
 
         void reset();
+
+        //
+        // The output for no input while steady
+        //
+        float output() const noexcept;
+
+        //
+        // true if the output is close enough to 0 to be considered silent
+        //
+        bool isSettled() const noexcept;
+
+        //
+        // true if processing no input leaves the filter as it is, so that
+        // every sample output is output(). The filter reaches this once
+        // its output has decayed to 0, or stalled just above it.
+        //
+        bool isSteady(float highPassRate) const noexcept;
     };
 
-    MixParam getMixParameters(uint32_t cycletime);
+    //
+    // Returns true if nothing is mixed in the buffer
+    //
+    bool isBufferEmpty() const noexcept;
+
+    //
+    // Returns true if nothing is mixed in the buffer and every accumulator
+    // is steady. Reading then outputs the accumulators' constant outputs,
+    // which is exactly what integrating the empty buffer would output.
+    //
+    bool isSteady() const noexcept;
+
+    MixParam getMixParameters(size_t channel, uint32_t cycletime);
+
+    //
+    // Adds a linearly interpolated step, for Synthesis::linear
+    //
+    template <MixMode mode, bool mono>
+    void mixLinear(MixParam param, float deltaLeft, float deltaRight);
+
+    //
+    // Adds a step to the nearest sample, for Synthesis::nearest
+    //
+    template <MixMode mode, bool mono>
+    void mixNearest(MixParam param, float deltaLeft, float deltaRight);
+
+    //
+    // Mixes a step with deltas already scaled by the terminal volumes
+    //
+    template <MixMode mode, bool mono = false>
+    void mixScaled(MixParam param, float deltaLeft, float deltaRight);
+
+    //
+    // Adds a step to the bins, for oversampled synthesis
+    //
+    template <MixMode mode, bool mono>
+    void mixBins(size_t channel, uint32_t cycletime, float deltaLeft, float deltaRight);
+
+    //
+    // Mixes scaled deltas with the given synthesis. In mono, the mode is
+    // MixMode::left and deltaLeft is the folded delta.
+    //
+    template <MixMode mode, Synthesis synthesis, bool mono>
+    void mixSynthesized(size_t channel, uint32_t cycletime, float deltaLeft, float deltaRight);
+
+    //
+    // Mixes the bins that ended by the given cycle time, and moves the rest
+    // to the start of the bin buffer
+    //
+    void decimate(uint32_t cycletime);
+
+    //
+    // Allocates the bins for the current buffer size and samplerate
+    //
+    void allocateBins();
 
-    float mVolumeStepLeft;
-    float mVolumeStepRight;
+    //
+    // Size of a bin region for the current buffer size, and the lower of
+    // the current and next samples per cycle
+    //
+    size_t binStride() const noexcept;
+
+    //
+    // Reallocates the bins with allocateBins, keeping their contents
+    //
+    void growBins();
+
+    //
+    // Sets mNextFactor from the rate ratio or the frame period
+    //
+    void updateNextFactor();
+
+    //
+    // Fills mKernel with a windowed-sinc kernel for the current settings
+    //
+    void generateKernel();
+
+    //
+    // Builds the table for the kernel format from mStepTable, call after
+    // the kernel or the format changes
+    //
+    void buildFormatTable();
+
+    //
+    // Number of stereo buffers in mBuffer, 4 with stems, 1 otherwise
+    //
+    size_t regions() const noexcept;
+
+    VolumeStep mVolume;
+
+    bool mMono;
+    size_t mTerminals;                  // number of interleaved terminals in the buffer, 1 in mono
 
     unsigned mSamplerate;
     float mFactor;                      // samples per cycle (multiply cycletime by this to get sampletime)
-
-    std::unique_ptr<float[]> mBuffer;   // sample buffer
-    size_t mBuffersize;                 // total size of the buffer
+    double mRateRatio;
+    float mNextFactor;                  // mFactor from the next flush, scaled by mRateRatio
+    uint32_t mFrameCycles;              // frame period, 0 if none
+    size_t mFrameSamples;               // samples per frame of the frame period, 0 to derive from the samplerate
+    size_t mFrameAdvance;               // samples the write index advanced by flushes in the current frame
+    float mFrameOffset;                 // fractional offset at the start of the current frame
+
+    Buffer<float> mBuffer;              // sample buffer
+    size_t mBuffersize;                 // total size of a buffer region (one per stem)
     std::array<Accum, 2> mAccumulators; // running sum state for each terminal
+    bool mStems;                        // mix each channel to its own region
+    size_t mChannelStride;              // distance between channel regions in mBuffer, 0 without stems
+    std::array<std::array<Accum, 2>, 4> mStemAccumulators;
     float mSampleOffset;                // fractional carry-over from previous frame
+    uint32_t mCycleBase;                // cycle time of the last flush in the current frame, 0 if none
     size_t mWriteIndex;                 // index to start mixing samples (samples before this index can be read)
+    size_t mMixEnd;                     // end of the mixed samples, the buffer is all zeros past this index
     float mHighpassRate;                // rate of the highpass filter
 
+    Mixer *mNext;                       // next mixer in the chain
+
+    // step kernel, (phases + 1) step sets of width samples each. The extra
+    // set is for interpolating the last phase.
+    float const* mStepTable;
+    size_t mStepWidth;
+    size_t mPhases;
+    Buffer<float> mKernel;              // storage for generated kernels
+
+    KernelFormat mFormat;
+    // symmetric: (phases + 1) half sets of width / 2 samples each
+    // fine: FINE_PHASES + 1 sets of width samples each
+    Buffer<float> mFormatTable;
+
+    Synthesis mSynthesis;
+    Buffer<float> mBins;                // deltas of each bin for each terminal, one region per stem
+    size_t mBinStride;                  // size of a bin region
+    uint32_t mBinOffset;                // cycles from the start of the first bin to the start of the frame
 
 };
 
 
 class Hardware;
-class Envelope;
+
+//
+// Synthesis backends for Hardware::run, a backend selects the synthesis at
+// compile time so that no synthesis is checked while running.
+//
+template <Synthesis s>
+struct Backend {
+    static constexpr Synthesis synthesis = s;
+};
+
+using BlepBackend = Backend<Synthesis::blep>;
+using LinearBackend = Backend<Synthesis::linear>;
+using NearestBackend = Backend<Synthesis::nearest>;
+using OversampledBackend = Backend<Synthesis::oversampled>;
+
+//
+// Any backend, for selecting the backend at runtime. Visit the variant once
+// per run, and not for every step.
+//
+using AnyBackend = std::variant<BlepBackend, LinearBackend, NearestBackend, OversampledBackend>;
+
+//
+// Gets the backend for the given synthesis
+//
+AnyBackend makeBackend(Synthesis synthesis) noexcept;
 
 //
 // Timer class for counting cycles. Each Channel has a frequency timer, which
@@ -271,10 +962,47 @@ private:
 
 };
 
+class Envelope {
+
+public:
+
+    explicit Envelope();
+
+    uint8_t readRegister() const noexcept;
+
+    void writeRegister(Channel &channel, uint8_t val) noexcept;
+
+    void clock() noexcept;
+
+    void restart() noexcept;
+
+    void reset() noexcept;
+
+    uint8_t volume() const noexcept;
+
+    //
+    // Returns true if a later clock will change the volume
+    //
+    bool isChanging() const noexcept;
+
+private:
+
+    // contents of the envelope register (NRx2)
+    uint8_t mRegister;
+
+    uint8_t mCounter;
+    uint8_t mPeriod;
+    bool mAmplify;
+    int8_t mVolume;
+};
+
+
 class NoiseChannel : public Channel {
 
 public:
-    explicit NoiseChannel(Envelope const& env);
+    explicit NoiseChannel();
+
+    Envelope& envelope() noexcept;
 
     void setNoise(uint8_t noisereg) noexcept;
 
@@ -286,13 +1014,34 @@ public:
 
     void fastforward(uint32_t cycles) noexcept;
 
+    //
+    // Edge walking, see PulseChannel. Edges are found using precomputed
+    // run lengths of the LFSR's output for each LFSR state.
+    //
+    void prepareEdges() noexcept;
+
+    uint32_t clocksToChange() const noexcept;
+
+    void advance(uint32_t clocks) noexcept;
+
+    //
+    // Returns true if clocking the channel cannot change its output, until
+    // the next register write or sequencer event.
+    //
+    bool isOutputInvariant() const noexcept;
+
 private:
 
     void updateOutput() noexcept;
 
     void clockLfsr() noexcept;
 
-    Envelope const& mEnvelope;
+    //
+    // Same as calling clockLfsr the given number of times
+    //
+    void jumpLfsr(uint32_t clocks) noexcept;
+
+    Envelope mEnvelope;
     bool mValidScf;
     bool mHalfWidth;
     uint16_t mLfsr;
@@ -310,7 +1059,9 @@ public:
         Duty75 = 3
     };
 
-    explicit PulseChannel(Envelope const& env);
+    explicit PulseChannel();
+
+    Envelope& envelope() noexcept;
 
     uint8_t duty() const noexcept;
 
@@ -324,11 +1075,32 @@ public:
 
     void fastforward(uint32_t cycles) noexcept;
 
+    //
+    // Edge walking. Instead of clocking the channel and checking each clock
+    // for a change in output, the channel can be advanced to its next edge.
+    // prepareEdges must be called before walking, clocksToChange returns the
+    // number of clocks until the output changes (0 if it never changes) and
+    // advance is the same as calling clock() the given number of times.
+    //
+    void prepareEdges() noexcept;
+
+    uint32_t clocksToChange() const noexcept;
+
+    void advance(uint32_t clocks) noexcept;
+
+    //
+    // Returns true if clocking the channel cannot change its output, until
+    // the next register write or sequencer event. This is the case while
+    // the envelope's volume is 0 and the output already reflects it, the
+    // duty has no effect then. Does not need prepareEdges.
+    //
+    bool isOutputInvariant() const noexcept;
+
 private:
 
     void updateOutput() noexcept;
 
-    Envelope const& mEnvelope;
+    Envelope mEnvelope;
     uint8_t mDuty;
     uint8_t mDutyWaveform;
 
@@ -351,7 +1123,12 @@ public:
 
     explicit WaveChannel();
 
-    uint8_t* waveram() noexcept;
+    uint8_t const* waveram() const noexcept;
+
+    //
+    // Writes a byte of wave RAM, updating the decoded samples
+    //
+    void writeWaveram(size_t index, uint8_t value) noexcept;
 
     uint8_t volume() const noexcept;
 
@@ -367,6 +1144,25 @@ public:
 
     void fastforward(uint32_t cycles) noexcept;
 
+    //
+    // Edge walking, see PulseChannel. The edges of the waveform are cached,
+    // prepareEdges only recalculates them after a write to wave RAM or the
+    // volume.
+    //
+    void prepareEdges() noexcept;
+
+    uint32_t clocksToChange() const noexcept;
+
+    void advance(uint32_t clocks) noexcept;
+
+    //
+    // Returns true if clocking the channel cannot change its output, until
+    // the next register write. This is the case when the volume is muted,
+    // or when every sample in wave RAM is the same after the volume shift.
+    // prepareEdges must be called first, since this uses the edge table.
+    //
+    bool isOutputInvariant() const noexcept;
+
 private:
 
     void updateSampleBuffer() noexcept;
@@ -379,63 +1175,42 @@ private:
     uint8_t mSampleBuffer;
     std::array<uint8_t, constants::WAVE_RAMSIZE> mWaveram;
 
+    // wave RAM decoded to one sample per wave position
+    std::array<uint8_t, constants::WAVE_RAMSIZE * 2> mSamples;
 
-};
-
-class LengthCounter {
-
-public:
-    explicit LengthCounter(unsigned max);
-
-    unsigned counter() const noexcept;
-
-    bool isEnabled() const noexcept;
-
-    void setCounter(unsigned value) noexcept;
-
-    void setEnable(bool enabled) noexcept;
-
-    void clock(Channel &channel) noexcept;
-
-    void reset() noexcept;
-
-    void restart() noexcept;
+    // edge cache, for each wave position: the number of clocks until the
+    // output changes, or 0 if the output is constant. Rebuilt by
+    // prepareEdges when dirty.
+    std::array<uint8_t, constants::WAVE_RAMSIZE * 2> mEdges;
+    bool mEdgesDirty;
 
-private:
-    bool mEnabled;
-    unsigned mCounter;
-    unsigned const mCounterMax;
 
 };
 
-
-class Envelope {
+class LengthCounter {
 
 public:
+    explicit LengthCounter(unsigned max);
 
-    explicit Envelope();
+    unsigned counter() const noexcept;
 
-    uint8_t readRegister() const noexcept;
+    bool isEnabled() const noexcept;
 
-    void writeRegister(Channel &channel, uint8_t val) noexcept;
+    void setCounter(unsigned value) noexcept;
 
-    void clock() noexcept;
+    void setEnable(bool enabled) noexcept;
 
-    void restart() noexcept;
+    void clock(Channel &channel) noexcept;
 
     void reset() noexcept;
 
-    uint8_t volume() const noexcept;
+    void restart() noexcept;
 
 private:
+    bool mEnabled;
+    unsigned mCounter;
+    unsigned mCounterMax;
 
-    // contents of the envelope register (NRx2)
-    uint8_t mRegister;
-
-    uint8_t mCounter;
-    uint8_t mPeriod;
-    bool mAmplify;
-    int8_t mVolume;
 };
 
 
@@ -506,6 +1281,127 @@ private:
 
 
 
+//
+// Records a channel's output for visualization. Each change in the channel's
+// DAC output is recorded as a transition along with running level statistics
+// for each terminal. Results are available for the previous frame after
+// Apu::endFrame, while the next frame is being recorded.
+//
+class Tap {
+
+public:
+
+    //
+    // Maximum number of transitions recorded per frame. Transitions past this
+    // are dropped, but are still counted in the level statistics.
+    //
+    static constexpr size_t CAPACITY = 1024;
+
+    struct Transition {
+        uint32_t cycletime;     // cycle time in the frame of the change
+        uint8_t output;         // the new output, 0-15
+    };
+
+    explicit Tap();
+
+    //
+    // Clears both frames and starts recording with the given output and mix
+    //
+    void reset(uint8_t output, MixMode mode) noexcept;
+
+    //
+    // Records a change in output at the given cycle time
+    //
+    void record(uint32_t cycletime, uint8_t output) noexcept {
+        advance(cycletime);
+        mLevel = output;
+        if (mCount[mRecording] < CAPACITY) {
+            mTransitions[mRecording][mCount[mRecording]++] = { cycletime, output };
+        } else {
+            mOverflowed = true;
+        }
+    }
+
+    //
+    // Records a change in the channel's mix at the given cycle time
+    //
+    void setMode(uint32_t cycletime, MixMode mode) noexcept;
+
+    //
+    // Finishes the frame, calculating the level statistics for each terminal
+    // using the given terminal scale (0.0 to 1.0), and starts a new one.
+    //
+    void endFrame(uint32_t cycletime, float leftScale, float rightScale) noexcept;
+
+    // results for the previous frame
+
+    //
+    // The channel's output at the start of the frame
+    //
+    uint8_t initialOutput() const noexcept;
+
+    Transition const* transitions() const noexcept;
+
+    size_t transitionCount() const noexcept;
+
+    //
+    // true if transitions were dropped due to the CAPACITY
+    //
+    bool overflowed() const noexcept;
+
+    //
+    // Peak and RMS levels of the channel's output on a terminal, 0 for
+    // left and 1 for right. Levels range from 0.0 to 1.0 with 1.0 being
+    // the maximum output at the maximum terminal volume.
+    //
+    float peak(size_t terminal) const noexcept;
+
+    float rms(size_t terminal) const noexcept;
+
+private:
+
+    //
+    // Accumulates the current level up to the given cycle time
+    //
+    void advance(uint32_t cycletime) noexcept {
+        auto const elapsed = cycletime - mCycletime;
+        mCycletime = cycletime;
+        if (elapsed && mLevel) {
+            uint64_t const energy = (uint64_t)elapsed * mLevel * mLevel;
+            if (modePansLeft(mMode)) {
+                mEnergy[0] += energy;
+                mPeakLevel[0] = std::max(mPeakLevel[0], mLevel);
+            }
+            if (modePansRight(mMode)) {
+                mEnergy[1] += energy;
+                mPeakLevel[1] = std::max(mPeakLevel[1], mLevel);
+            }
+        }
+    }
+
+    // transitions are double buffered, one for the frame being recorded
+    // and one for the results of the previous frame
+    std::array<std::array<Transition, CAPACITY>, 2> mTransitions;
+    std::array<size_t, 2> mCount;
+    std::array<uint8_t, 2> mInitial;
+    size_t mRecording;
+
+    uint32_t mCycletime;
+    uint8_t mLevel;
+    MixMode mMode;
+    bool mOverflowed;
+    std::array<uint64_t, 2> mEnergy;
+    std::array<uint8_t, 2> mPeakLevel;
+
+    // results
+    bool mLastOverflowed;
+    std::array<float, 2> mPeak;
+    std::array<float, 2> mRms;
+
+};
+
+using ChannelTaps = std::array<Tap, 4>;
+
 class Hardware {
 
     using ChannelTuple = std::tuple<PulseChannel, PulseChannel, WaveChannel, NoiseChannel>;
@@ -562,8 +1458,7 @@ public:
         static_assert(channel != 2, "WaveChannel has no envelope");
         static_assert(channel < 4, "unknown channel");
 
-        constexpr auto index = channel > 2 ? 2 : channel;
-        return mEnvelopes[index];
+        return std::get<channel>(mChannels).envelope();
 
     }
 
@@ -585,7 +1480,12 @@ public:
         envelope<channel>().writeRegister(std::get<channel>(mChannels), value);
     }
 
-    void setMix(ChannelMix const& mix, Mixer &mixer, uint32_t cycletime) noexcept;
+    void setMix(ChannelMix const& mix, Mixer &mixer, VolumeStep const& volume, uint32_t cycletime) noexcept;
+
+    //
+    // Sets the mix without mixing the DC offsets for the change
+    //
+    void setMix(ChannelMix const& mix) noexcept;
 
     ChannelMix const& mix() const noexcept;
 
@@ -593,35 +1493,67 @@ public:
 
     uint8_t lastOutput(size_t channel) const noexcept;
 
+    //
+    // Returns true if no channel can mix a change in output until the next
+    // register write: every channel is muted, off, or has a constant output
+    // that has already been mixed and an envelope that will not change its
+    // volume.
+    //
+    bool isIdle() noexcept;
+
+
+    //
+    // Runs the hardware for the given number of cycles, mixing changes in
+    // output to the mixer with the given volume and backend, which must
+    // match the mixer's synthesis. If taps is not nullptr, the changes are
+    // also recorded to each channel's tap.
+    //
+    template <class Backend>
+    void run(Mixer &mixer, VolumeStep const& volume, uint32_t cycletime, uint32_t cycles, ChannelTaps *taps = nullptr) noexcept;
+
+    //
+    // Runs the hardware for the given number of cycles without mixing. The
+    // resulting state, including the last outputs, is the same as if run()
+    // was called instead.
+    //
+    void fastforward(uint32_t cycles) noexcept;
 
-    void run(Mixer &mixer, uint32_t cycletime, uint32_t cycles) noexcept;
+    //
+    // Same as fastforward, except that the last outputs are kept. The next
+    // run() then mixes the change in output over the skipped cycles as a
+    // single step, so that the mixer stays in sync with the hardware.
+    //
+    void skip(uint32_t cycles) noexcept;
 
 
 private:
 
     //
-    // Runs the channel and mixes any changes in output
+    // Runs the channel and mixes any changes in output, with the channel's
+    // mix mode, or muted if the channel is disabled or its DAC is off.
     //
-    template <class Channel>
-    void runChannel(size_t index, Channel &ch, Mixer &mixer, uint32_t cycletime, uint32_t cycles) noexcept;
+    template <class Backend, class Channel>
+    void runChannel(size_t index, Channel &ch, Mixer &mixer, VolumeStep const& volume, Tap *tap, uint32_t cycletime, uint32_t cycles) noexcept;
 
-    template <class Channel, MixMode mode>
-    void runAndMixChannel(size_t index, Channel &ch, Mixer &mixer, uint32_t cycletime, uint32_t cycles) noexcept;
+    //
+    // Runs the channel with the given mix mode, muted channels are only
+    // fastforwarded
+    //
+    template <class Backend, class Channel, MixMode mode>
+    void runAndMixChannel(size_t index, Channel &ch, Mixer &mixer, VolumeStep const& volume, Tap *tap, uint32_t cycletime, uint32_t cycles) noexcept;
 
     //
-    // Determines which mix mode to use for the given channel. If the channel was disabled or the
-    // DAC is off, the channel is silenced and muted mixing is returned. Otherwise, the
-    // channel's mix setting is used.
+    // Same as runChannel, but the changes in output are only recorded
     //
-    MixMode preRunChannel(size_t index, Channel &ch, Mixer &mixer, uint32_t cycletime) noexcept;
+    template <class Channel>
+    void fastforwardChannel(size_t index, Channel &ch, uint32_t cycles) noexcept;
 
     //
     // Silence the given channel
     //
-    void silence(size_t channel, Mixer &mixer, uint32_t cycletime) noexcept;
+    void silence(size_t channel, Mixer &mixer, VolumeStep const& volume, Tap *tap, uint32_t cycletime) noexcept;
 
     std::array<LengthCounter, 4> mLengthCounters;
-    std::array<Envelope, 3> mEnvelopes;
     Sweep mSweep;
 
     Sequencer mSequencer;
@@ -643,6 +1575,23 @@ private:
 
 } // gbapu::_internal
 
+//
+// What Apu::step does when a step would mix past the end of an output's
+// buffer. Steps are checked once, and split at the buffer's capacity, so
+// that nothing is checked while mixing.
+//
+enum class OverflowPolicy {
+    grow,       // grow the buffer to fit the step (allocates)
+    flush       // send the finished samples to the sink, see Apu::setSink.
+                // Grows instead if no sink is set.
+};
+
+//
+// Receives interleaved stereo samples from an Apu, for the given output
+// (0 for the main output, see Apu::addOutput).
+//
+using SampleSink = std::function<void(size_t output, float const* samples, size_t count)>;
+
 class Apu {
 
 public:
@@ -680,13 +1629,68 @@ public:
         REG_WAVERAM = 0x30
     };
 
+    //
+    // Snapshot of the hardware and register state. States are saved and
+    // restored at frame boundaries, the sample buffer and filter state are
+    // not part of the snapshot.
+    //
+    struct State {
+        _internal::Hardware hardware;
+        uint8_t nr51;
+        uint8_t leftVolume;
+        uint8_t rightVolume;
+        bool enabled;
+        float sampleOffset;     // fractional sample time of the next frame
+        // same as sampleOffset, for each additional output
+        std::vector<float> outputSampleOffsets;
+    };
+
     explicit Apu(
         unsigned samplerate,
         size_t buffersizeInSamples
     );
 
+    //
+    // Creates an Apu for real-time use, that allocates its buffers with the
+    // given allocator, which must outlive the Apu.
+    //
+    // Once constructed and configured, none of step, stepTo, writeRegister,
+    // readRegister, endFrame, availableSamples, readSamples, readStems,
+    // removeSamples, or run (with a sink that does not allocate) allocate
+    // memory, as long as the buffer is read every frame or a sink is set.
+    // The overflow policy defaults to OverflowPolicy::flush, which still
+    // grows the buffer while no sink is set.
+    // Configuration functions (setBuffersize, addOutput, setKernel, etc)
+    // may allocate, but only through the allocator.
+    //
+    Apu(
+        unsigned samplerate,
+        size_t buffersizeInSamples,
+        Allocator &allocator
+    );
+
     void reset() noexcept;
 
+    //
+    // Saves the current state. Should only be called right after endFrame.
+    //
+    State saveState() const;
+
+    //
+    // Restores a state from saveState, the sample buffer is cleared. The
+    // additional outputs should be the same as when saved, outputs that
+    // were not saved start at a sample offset of 0.
+    //
+    void restoreState(State const& state);
+
+    //
+    // Enables or disables mixing, enabled by default. While disabled, only
+    // the hardware state is emulated and nothing is mixed into the buffer.
+    // Frames still produce samples, but they are all silent. Not to be
+    // confused with setSynthesis, which selects how changes are mixed.
+    //
+    void setMixing(bool enabled);
+
     //
     // Step the emulator for a given number of cycles.
     //
@@ -702,6 +1706,81 @@ public:
     //
     void endFrame();
 
+    //
+    // Streaming: runs for the given number of cycles, ending frames as
+    // needed and sending the samples to the sink (see setSink) in blocks of
+    // the block size. Samples that do not fill a block stay in the buffer
+    // for the next call, samples are dropped if no sink is set. A long
+    // render can be done with a single call. Ends the current frame first.
+    //
+    void run(uint64_t cycles);
+
+    //
+    // Same as run, but runs until the given time (see time())
+    //
+    void runTo(uint64_t time);
+
+    //
+    // Total number of cycles stepped since the last reset. Unlike the
+    // frame's cycle time, this does not wrap or restart at endFrame.
+    //
+    uint64_t time() const noexcept;
+
+    //
+    // Number of samples per block sent to the sink by run, 0 (the default)
+    // to send all samples available at the end of each frame. Grows the
+    // buffers so they can hold a block and a frame.
+    //
+    void setBlockSize(size_t samples);
+
+    //
+    // Length of the frames that run ends, in cycles, when no frame period
+    // is set
+    //
+    static constexpr uint32_t STREAM_FRAME_CYCLES = 70224;
+
+    //
+    // Sets a fixed frame period in cycles, or 0 to disable, see
+    // Mixer::setFramePeriod. Every frame ended at exactly the period yields
+    // exactly samplesPerFrame() samples in each output, so buffers can be
+    // sized once without checking the count of each frame. The samplerate
+    // is adjusted to the nearest whole number of samples per frame. run
+    // ends frames of this period instead of STREAM_FRAME_CYCLES. Takes
+    // effect at the next endFrame, or right away after reset or
+    // clearSamples.
+    //
+    void setFramePeriod(uint32_t cycles);
+
+    //
+    // Number of samples the given output yields per frame of the frame
+    // period, 0 when disabled
+    //
+    size_t samplesPerFrame(size_t output = 0) const noexcept;
+
+    //
+    // Enables turbo mode for fast-forwarding, with the given speed factor (1
+    // to disable). Of every factor slices of the given length, in cycles,
+    // only the first is synthesized. The others are skipped with the same
+    // cost as fastforwarding, the hardware state stays exact. The output is
+    // a time-compressed stream at the normal samplerate, factor times
+    // shorter than the time stepped, so the cost of synthesis does not rise
+    // with the speed of emulation. A factor or slice length of 0 is treated
+    // as 1.
+    //
+    // Changes in output over a skipped slice are mixed as one step at the
+    // start of the next slice. Register writes in skipped slices take effect
+    // at the start of the next slice too. time() is still in emulated
+    // cycles.
+    //
+    void setTurbo(unsigned factor, uint32_t sliceCycles = TURBO_SLICE_CYCLES);
+
+    unsigned turbo() const noexcept;
+
+    //
+    // Default slice length for turbo mode, in cycles (~4 ms)
+    //
+    static constexpr uint32_t TURBO_SLICE_CYCLES = 16384;
+
     uint8_t readRegister(uint8_t reg, uint32_t autostep = 12);
 
     void writeRegister(uint8_t reg, uint8_t value, uint32_t autostep = 12);
@@ -714,6 +1793,27 @@ public:
 
     size_t readSamples(float *dest, size_t samples);
 
+    //
+    // Reads per-channel stems along with the normal output, see
+    // Mixer::readStems. Stems must be enabled first with setStems.
+    //
+    size_t readStems(float *dest, std::array<float*, 4> const& stems, size_t samples);
+
+    //
+    // Reads samples before integration, see Mixer::readDeltas
+    //
+    size_t readDeltas(float *dest, size_t samples);
+
+    //
+    // Integrates samples from readDeltas, continuing this Apu's filter state
+    //
+    void integrate(float *buf, size_t samples);
+
+    //
+    // Drops the given number of samples from the buffer without reading them
+    //
+    void removeSamples(size_t samples);
+
     void clearSamples();
 
 
@@ -721,31 +1821,239 @@ public:
 
     void setVolume(float gain);
 
+    //
+    // Sets the samplerate of the main output, additional outputs keep the
+    // samplerate they were added with
+    //
     void setSamplerate(unsigned samplerate);
 
+    //
+    // Scales the samplerate of every output by the given ratio, for dynamic
+    // rate control (ie 1.005 for 0.5% more samples). The ratio takes effect
+    // at the next endFrame, without clearing the buffer or resetting the
+    // filter. Invalid ratios (0, negative or not finite) are ignored, see
+    // Mixer::setRateRatio.
+    //
+    void setRateRatio(double ratio);
+
+    //
+    // Sets the buffer size of the main output, additional outputs keep the
+    // buffer size they were added with
+    //
     void setBuffersize(size_t samples);
 
+    //
+    // Enables or disables per-channel stem outputs. Clears the buffer.
+    //
+    void setStems(bool enabled);
+
+    //
+    // Enables or disables mono for all outputs, see Mixer::setMono. Samples
+    // read, and sent to the sink, are one float each in mono. Clears the
+    // buffer.
+    //
+    void setMono(bool enabled);
+
+    //
+    // Sets the bandlimited step kernel for all outputs, see
+    // Mixer::setKernel for how unsupported widths and phases are adjusted.
+    // Narrow kernels are faster, wide kernels have less aliasing.
+    //
+    void setKernel(size_t width, size_t phases = 32);
+
+    //
+    // Sets the kernel storage format for all outputs, see KernelFormat.
+    //
+    void setKernelFormat(KernelFormat format);
+
+    //
+    // Sets the synthesis for all outputs, see Mixer::setSynthesis. Clears
+    // the buffer.
+    //
+    void setSynthesis(Synthesis synthesis);
+
+    //
+    // Sets what step does when the buffer cannot hold the cycles stepped,
+    // the default is OverflowPolicy::grow, or OverflowPolicy::flush for an
+    // Apu constructed with an allocator. Grown buffers are not shrunk until
+    // setBuffersize.
+    //
+    void setOverflowPolicy(OverflowPolicy policy);
+
+    //
+    // Sets the sink for run and for OverflowPolicy::flush. For a flush, the
+    // sink is called from step, in the middle of a frame, with the samples
+    // that are finished. Any samples in the buffer before the flush are
+    // sent too.
+    //
+    void setSink(SampleSink sink);
+
+    //
+    // Returns true if the APU is silent: the samples left to read are all
+    // under one 16-bit LSB, and the channels cannot produce a change in
+    // output until the next register write (an envelope changing a channel's
+    // volume counts as a change). Frontends can use this to pause the
+    // audio device, while still stepping the APU and checking this after
+    // each frame.
+    //
+    bool isSilent() noexcept;
+
+    // additional outputs
+
+    //
+    // Adds an output with its own samplerate and buffer, returning its
+    // index. The main output is index 0. Every output is mixed from the same
+    // hardware run, so additional outputs only cost the mixing and not the
+    // emulation. Outputs are cleared by reset, restoreState and clearSamples.
+    //
+    size_t addOutput(unsigned samplerate, size_t buffersizeInSamples);
+
+    //
+    // Removes all additional outputs
+    //
+    void clearOutputs();
+
+    //
+    // Number of outputs, including the main output
+    //
+    size_t outputs() const noexcept;
+
+    size_t availableSamples(size_t output);
+
+    size_t readSamples(size_t output, float *dest, size_t samples);
+
+    // shared output
+
+    //
+    // Mixes this Apu into the outputs of a host Apu, or back into its own
+    // outputs with nullptr. Several Apus can share a host, for example one
+    // for music and one for sound effects, so that a single buffer is
+    // integrated, filtered and read for all of them. Each Apu keeps its own
+    // volume (setVolume and NR50), its steps are mixed into the host with it.
+    //
+    // While mixing into a host:
+    //  - This Apu's own buffer is freed, samples are read from the host
+    //  - Steps must stay within the host's frame: step this Apu to the
+    //    host's cycle time before calling endFrame on both
+    //  - Overflows always grow the host's buffers
+    //  - Synthesis, kernel and stems are the host's settings
+    //
+    // The host must outlive this Apu, or be unset first, and cannot itself
+    // mix into a host. Changes in output are only mixed from when the host
+    // is set, so set it while the channels are silent (after reset).
+    //
+    void setHost(Apu *host);
+
+    Apu* host() const noexcept;
+
+    //
+    // Enables or disables the channel taps, disabled by default. Taps record
+    // each channel's output transitions and levels while synthesizing, for
+    // oscilloscopes and level meters.
+    //
+    void setTaps(bool enabled);
+
+    //
+    // Gets the tap for a channel, taps must be enabled. The tap's results are
+    // for the last frame ended by endFrame.
+    //
+    _internal::Tap const& tap(size_t channel) const noexcept;
+
 private:
 
     void updateVolume();
 
+    void resetTaps() noexcept;
+
+    //
+    // Runs and mixes the given number of cycles, ignoring turbo mode
+    //
+    void synthesize(uint32_t cycles);
+
+    //
+    // Length of the frames that run ends, in cycles
+    //
+    uint32_t streamFrameCycles() const noexcept;
+
+    //
+    // Number of cycles that every output can mix past the current cycle time
+    //
+    uint32_t cyclesAvailable() const noexcept;
+
+    //
+    // Makes room for stepping the given number of cycles, using the
+    // overflow policy
+    //
+    void handleOverflow(uint32_t cycles);
+
+    //
+    // Sends all complete blocks of the given output to the sink
+    //
+    void sendBlocks(size_t index, _internal::Mixer &mixer);
+
+    //
+    // Sizes the flush buffer for the largest read from any output, so that
+    // overflows and blocks are sent without allocating
+    //
+    void reserveFlushBuffer();
+
+    //
+    // Grows every output to mix the given number of cycles past the given
+    // cycle time
+    //
+    void growOutputs(uint32_t cycletime, uint32_t cycles);
+
+    //
+    // Mixer the hardware mixes to, the host's when mixing into a host
+    //
+    _internal::Mixer& targetMixer() noexcept;
+
+
+    Allocator *mAllocator;
+
     _internal::Mixer mMixer;
 
+    // additional outputs, chained after mMixer
+    // additional outputs, allocated with mAllocator
+    std::vector<_internal::Allocated<_internal::Mixer>, _internal::ContainerAllocator<_internal::Allocated<_internal::Mixer>>> mOutputs;
+
     uint8_t mNr51;
 
     _internal::Hardware mHardware;
 
+    // allocated when taps are enabled
+    _internal::Allocated<_internal::ChannelTaps> mTaps;
+
     uint32_t mCycletime;
+    uint64_t mFrameTime;    // time() of the start of the current frame
+    uint32_t mMixTime;      // cycle time in the mixers, behind mCycletime by the cycles skipped in turbo mode
+
+    unsigned mTurbo;        // turbo factor, 1 when disabled
+    uint32_t mTurboSlice;
+    uint64_t mTurboPhase;   // cycles into the current turbo period
 
     // mixer
     uint8_t mLeftVolume;
     uint8_t mRightVolume;
 
     bool mEnabled;
+    bool mMixing;
 
     float mVolumeStep;
     unsigned mSamplerate;
     size_t mBuffersize;
+    size_t mKernelWidth;
+    size_t mKernelPhases;
+    KernelFormat mKernelFormat;
+    double mRateRatio;
+    uint32_t mFramePeriod;
+
+    OverflowPolicy mOverflowPolicy;
+    SampleSink mSink;
+    _internal::Buffer<float> mFlushBuffer;
+    size_t mBlockSize;
+
+    Apu *mHost;
 
 };
 
@@ -0,0 +1,398 @@
+
+#ifndef GBAPU_RENDER_HPP
+#define GBAPU_RENDER_HPP
+
+#include "gbapu.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstddef>
+#include <cstdio>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace gbapu {
+
+namespace _internal {
+
+//
+// Fixed-size pool of worker threads. Work is submitted as a batch of
+// indices, which are distributed evenly to each worker's queue. A worker
+// takes items from the front of its own queue, and when that runs dry it
+// steals from the back of the other workers' queues.
+//
+class ThreadPool {
+
+public:
+
+    using Task = std::function<void(size_t index, unsigned worker)>;
+
+    //
+    // Creates a pool with the given number of workers, 0 for one worker per
+    // hardware thread.
+    //
+    explicit ThreadPool(unsigned threads);
+    ~ThreadPool();
+
+    //
+    // Number of worker threads in the pool
+    //
+    unsigned size() const noexcept;
+
+    //
+    // Calls task for each index in [0, count) and blocks until all calls
+    // have completed. The worker argument is the id of the calling worker,
+    // [0, size()), and can be used to index per-worker resources. If a call
+    // throws, the calls not yet started are skipped and the first exception
+    // is rethrown once the others have completed.
+    //
+    void run(size_t count, Task const& task);
+
+private:
+
+    struct Queue {
+        std::mutex mutex;
+        std::deque<size_t> items;
+    };
+
+    void workerMain(unsigned worker);
+
+    //
+    // Gets the next item for the given worker, stealing if needed. Returns
+    // false when there is no work left in any queue.
+    //
+    bool next(unsigned worker, size_t &index);
+
+    unsigned mSize;
+    std::unique_ptr<Queue[]> mQueues;
+    std::vector<std::thread> mThreads;
+
+    std::mutex mMutex;
+    std::condition_variable mWorkReady;
+    std::condition_variable mWorkDone;
+    Task const* mTask;
+    uint64_t mGeneration;   // incremented for each batch submitted by run()
+    unsigned mBusy;         // number of workers still processing the batch
+    bool mQuit;
+    std::exception_ptr mError;  // first exception thrown by the batch
+    std::atomic<bool> mFailed;  // set with mError, checked without the lock
+
+};
+
+} // gbapu::_internal
+
+//
+// A register write in a render script. The time is in cycles, relative to
+// the start of the render.
+//
+struct RegisterWrite {
+    uint64_t time;
+    uint8_t reg;
+    uint8_t value;
+};
+
+//
+// Receives interleaved stereo samples from a render, in order. Renderer::render
+// calls the sink once per frame, Renderer::renderSegmented once per segment.
+//
+using RenderSink = std::function<void(float const* samples, size_t count)>;
+
+//
+// A song or register trace to render. Writes in the script must be sorted by
+// time, writes past the duration are ignored.
+//
+struct RenderJob {
+    std::vector<RegisterWrite> script;
+    uint64_t duration;      // length of the render, in cycles
+    RenderSink sink;
+};
+
+//
+// Aggregate throughput of a call to Renderer::render
+//
+struct RenderStats {
+    size_t jobs = 0;
+    uint64_t cycles = 0;                // total cycles emulated
+    uint64_t samples = 0;               // total samples generated
+    std::chrono::nanoseconds elapsed{}; // wall clock time of the render
+
+    //
+    // Duration of the audio generated divided by the time it took to
+    // generate it.
+    //
+    double ratio() const noexcept;
+
+    //
+    // Samples generated per second of wall clock time
+    //
+    double samplesPerSecond() const noexcept;
+};
+
+//
+// Offline renderer for batches of independent jobs. Each job is rendered on
+// its own Apu, jobs are spread across a work-stealing thread pool. Every
+// worker keeps its Apu and frame buffer between jobs, so buffers are only
+// allocated once per worker.
+//
+class Renderer {
+
+public:
+
+    //
+    // Length of a render frame in cycles, samples are sent to the sink once
+    // per frame (one DMG video frame, ~59.7 Hz)
+    //
+    static constexpr uint32_t CYCLES_PER_FRAME = 70224;
+
+    //
+    // Creates a renderer with the given output samplerate, and number of
+    // worker threads (0 for one per hardware thread).
+    //
+    explicit Renderer(unsigned samplerate, unsigned threads = 0);
+    ~Renderer();
+
+    //
+    // Renders all jobs, blocking until they have completed. Sinks are
+    // called from the worker threads, a job's sink is only called by one
+    // worker at a time. If a sink throws, the jobs not yet started are
+    // skipped and the exception is rethrown here, on the calling thread.
+    //
+    RenderStats render(std::vector<RenderJob> const& jobs);
+
+    //
+    // Renders a single job by splitting it into segments of the given
+    // number of frames, which are synthesized in parallel. The output is the
+    // same as rendering the job with render().
+    //
+    // This is done in two passes. The first pass runs the entire script
+    // without mixing, saving the Apu's state at the start of each
+    // segment. The second pass synthesizes the segments from the saved
+    // states on the thread pool. Each segment also synthesizes the frame
+    // before it, so that the steps mixed near the seam are complete, and
+    // the segments are then integrated in order so that the filter state
+    // carries over from one segment to the next. The sink is called from
+    // the calling thread, and exceptions thrown by the workers are rethrown
+    // on it too.
+    //
+    RenderStats renderSegmented(RenderJob const& job, size_t framesPerSegment = 600);
+
+    unsigned samplerate() const noexcept;
+
+    unsigned threads() const noexcept;
+
+private:
+
+    //
+    // Resources owned by a worker, reused for each job the worker renders
+    //
+    struct Worker {
+        std::unique_ptr<Apu> apu;
+        std::unique_ptr<float[]> frameBuf;
+        uint64_t cycles;
+        uint64_t samples;
+    };
+
+    //
+    // A segment for renderSegmented
+    //
+    struct Segment {
+        Apu::State state;       // state at the start of the first frame to synthesize
+        uint64_t firstFrame;    // first frame to synthesize, includes the pre-roll frame
+        uint64_t startFrame;    // first frame of the segment's output
+        uint64_t endFrame;      // end of the segment (exclusive)
+        size_t samples;         // samples in the segment's output
+    };
+
+    using FrameCallback = std::function<void(uint64_t frame)>;
+
+    void renderJob(RenderJob const& job, Worker &worker);
+
+    //
+    // Runs frames [first, last) of the job's script on the given Apu. The
+    // Apu must be in the state it would be at the start of the first frame.
+    // The callback is called after each frame has ended.
+    //
+    void runFrames(
+        Apu &apu,
+        RenderJob const& job,
+        uint64_t first,
+        uint64_t last,
+        FrameCallback const& callback
+    );
+
+    void renderSegment(RenderJob const& job, Segment const& segment, std::vector<float> &output, Worker &worker);
+
+    unsigned mSamplerate;
+    size_t mSamplesPerFrame;
+    _internal::ThreadPool mPool;
+    std::vector<Worker> mWorkers;
+
+    // Apu for the first pass of renderSegmented and for integrating the
+    // segments in the second pass
+    std::unique_ptr<Apu> mSeeker;
+    std::vector<std::vector<float>> mSegmentBuffers;
+
+};
+
+//
+// Sample format of an AudioWriter's output
+//
+enum class SampleFormat {
+    f32,        // 32-bit float, as generated
+    s16         // 16-bit signed integer, clamped and rounded, NaN is 0
+};
+
+//
+// Container of an AudioWriter's output
+//
+enum class Container {
+    wav,        // RIFF wave, little-endian
+    raw         // headerless interleaved PCM, for piping to an encoder
+};
+
+//
+// Streaming writer for offline renders. Samples are converted into one of
+// two large blocks, when a block is full it is handed to a background thread
+// that writes it out in a single call while the other block is filled. The
+// caller only waits when the disk falls a whole block behind.
+//
+// A wav header is written up front with the sizes unknown (0xFFFFFFFF), and
+// patched on close if the output can seek. Output that cannot seek (pipes,
+// stdout) keeps the unknown sizes, which is what most readers expect of a
+// streamed wav.
+//
+class AudioWriter {
+
+public:
+
+    //
+    // Size of each of the two blocks, in bytes
+    //
+    static constexpr size_t DEFAULT_BLOCK_SIZE = 1 << 20;
+
+    //
+    // Opens the given file for writing, "-" for stdout. Existing files are
+    // overwritten. Check good() to see if the file was opened.
+    //
+    explicit AudioWriter(
+        std::string const& path,
+        unsigned samplerate,
+        unsigned channels = 2,
+        SampleFormat format = SampleFormat::f32,
+        Container container = Container::wav,
+        size_t blockSize = DEFAULT_BLOCK_SIZE
+    );
+
+    //
+    // Writes to an already open stream, ie a pipe from popen. The stream is
+    // not closed by the writer.
+    //
+    explicit AudioWriter(
+        std::FILE *stream,
+        unsigned samplerate,
+        unsigned channels = 2,
+        SampleFormat format = SampleFormat::f32,
+        Container container = Container::wav,
+        size_t blockSize = DEFAULT_BLOCK_SIZE
+    );
+
+    //
+    // Closes the writer, see close()
+    //
+    ~AudioWriter();
+
+    //
+    // Writes count frames of interleaved samples, count * channels() values
+    // are read from the buffer.
+    //
+    void write(float const* samples, size_t count);
+
+    //
+    // Returns a sink that writes to this writer, for RenderJob::sink. The
+    // writer must outlive the render.
+    //
+    RenderSink sink();
+
+    //
+    // Writes out any buffered samples, waits for the background thread to
+    // finish and patches the wav header. Returns good(). Writing after the
+    // writer was closed does nothing.
+    //
+    bool close();
+
+    //
+    // false if the output could not be opened or a write has failed
+    //
+    bool good() const noexcept;
+
+    //
+    // Number of frames written so far
+    //
+    uint64_t frames() const noexcept;
+
+    unsigned channels() const noexcept;
+
+    SampleFormat format() const noexcept;
+
+private:
+
+    // non-copyable, non-movable, the background thread refers to this
+    AudioWriter(AudioWriter const&) = delete;
+    AudioWriter& operator=(AudioWriter const&) = delete;
+
+    AudioWriter(
+        std::FILE *stream,
+        bool owned,
+        unsigned samplerate,
+        unsigned channels,
+        SampleFormat format,
+        Container container,
+        size_t blockSize
+    );
+
+    void writeHeader(uint64_t frames);
+
+    //
+    // Hands the front block to the background thread, waiting for it to
+    // finish the previous one, and swaps blocks
+    //
+    void submit();
+
+    void ioMain();
+
+    std::FILE *mStream;
+    bool mOwned;        // mStream was opened by the writer
+    unsigned mSamplerate;
+    unsigned mChannels;
+    SampleFormat mFormat;
+    Container mContainer;
+    size_t mSampleSize; // bytes per sample value
+
+    size_t mBlockSize;
+    std::unique_ptr<char[]> mBlocks[2];
+    char *mFront;       // block being filled by write()
+    size_t mFrontSize;  // bytes in the front block
+    uint64_t mFrames;
+
+    std::mutex mMutex;
+    std::condition_variable mCond;
+    char const* mPending;   // block being written by the thread, if any
+    size_t mPendingSize;
+    std::atomic<bool> mFailed;
+    bool mQuit;
+    bool mClosed;
+    std::thread mThread;
+
+};
+
+} // gbapu
+
+#endif // GBAPU_RENDER_HPP
@@ -0,0 +1,78 @@
+
+#include "gbapu.hpp"
+
+#include <new>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+namespace gbapu {
+
+// ======================================================== AlignedAllocator ===
+
+AlignedAllocator::AlignedAllocator(size_t alignment) noexcept :
+    mAlignment(alignment)
+{
+}
+
+void* AlignedAllocator::allocate(size_t bytes, size_t alignment) {
+    alignment = std::max(alignment, mAlignment);
+    auto ptr = ::operator new(bytes, std::align_val_t(alignment));
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+    if (alignment >= HUGE_PAGE_SIZE && bytes >= HUGE_PAGE_SIZE) {
+        // only whole huge pages, failing is harmless
+        madvise(ptr, bytes & ~(HUGE_PAGE_SIZE - 1), MADV_HUGEPAGE);
+    }
+#endif
+    return ptr;
+}
+
+void AlignedAllocator::deallocate(void *ptr, size_t bytes, size_t alignment) noexcept {
+    ::operator delete(ptr, bytes, std::align_val_t(std::max(alignment, mAlignment)));
+}
+
+// ========================================================== ArenaAllocator ===
+
+ArenaAllocator::ArenaAllocator(void *memory, size_t size) noexcept :
+    mMemory(static_cast<char*>(memory)),
+    mSize(size),
+    mUsed(0)
+{
+}
+
+void* ArenaAllocator::allocate(size_t bytes, size_t alignment) {
+    // align the address, not the offset, since the memory given may not be
+    // aligned itself
+    auto const address = reinterpret_cast<uintptr_t>(mMemory) + mUsed;
+    auto const padding = (alignment - (address & (alignment - 1))) & (alignment - 1);
+    if (padding > mSize - mUsed || bytes > mSize - mUsed - padding) {
+        throw std::bad_alloc();
+    }
+    auto ptr = mMemory + mUsed + padding;
+    mUsed += padding + bytes;
+    return ptr;
+}
+
+void ArenaAllocator::deallocate(void *ptr, size_t bytes, size_t alignment) noexcept {
+    (void)ptr;
+    (void)bytes;
+    (void)alignment;
+}
+
+void ArenaAllocator::release() noexcept {
+    mUsed = 0;
+}
+
+size_t ArenaAllocator::used() const noexcept {
+    return mUsed;
+}
+
+// ======================================================== defaultAllocator ===
+
+Allocator& defaultAllocator() noexcept {
+    static AlignedAllocator allocator;
+    return allocator;
+}
+
+}
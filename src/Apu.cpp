@@ -2,35 +2,111 @@
 #include "gbapu.hpp"
 
 #include <algorithm>
+#include <cassert>
 
 namespace gbapu {
 
 Apu::Apu(unsigned samplerate, size_t buffersizeInSamples) :
-    mMixer(),
+    Apu(samplerate, buffersizeInSamples, defaultAllocator())
+{
+    mOverflowPolicy = OverflowPolicy::grow;
+}
+
+Apu::Apu(unsigned samplerate, size_t buffersizeInSamples, Allocator &allocator) :
+    mAllocator(&allocator),
+    mMixer(allocator),
+    mOutputs(_internal::ContainerAllocator<_internal::Allocated<_internal::Mixer>>(allocator)),
+    mNr51(0),
     mHardware(),
+    mTaps(nullptr, _internal::AllocatedDelete<_internal::ChannelTaps>(allocator)),
     mCycletime(0),
+    mFrameTime(0),
+    mMixTime(0),
+    mTurbo(1),
+    mTurboSlice(TURBO_SLICE_CYCLES),
+    mTurboPhase(0),
     mLeftVolume(1),
     mRightVolume(1),
     mEnabled(false),
+    mMixing(true),
     mSamplerate(samplerate),
-    mBuffersize(buffersizeInSamples)
+    mBuffersize(buffersizeInSamples),
+    mKernelWidth(0),
+    mKernelPhases(0),
+    mKernelFormat(KernelFormat::full),
+    mRateRatio(1.0),
+    mFramePeriod(0),
+    mOverflowPolicy(OverflowPolicy::flush),
+    mSink(),
+    mFlushBuffer(allocator),
+    mBlockSize(0),
+    mHost(nullptr)
 {
     setVolume(1.0f);
     mMixer.setBuffer(mBuffersize);
     mMixer.setSamplerate(samplerate);
+    reserveFlushBuffer();
 }
 
 void Apu::reset() noexcept {
     mCycletime = 0;
-    mMixer.clear();
+    mFrameTime = 0;
+    mMixTime = 0;
+    mTurboPhase = 0;
+    clearSamples();
 
     mHardware.reset();
 
+    mNr51 = 0;
     mLeftVolume = 1;
     mRightVolume = 1;
     mEnabled = false;
 
     updateVolume();
+    resetTaps();
+}
+
+Apu::State Apu::saveState() const {
+    std::vector<float> outputSampleOffsets;
+    outputSampleOffsets.reserve(mOutputs.size());
+    for (auto const& output : mOutputs) {
+        outputSampleOffsets.push_back(output->sampleOffset());
+    }
+
+    return {
+        mHardware,
+        mNr51,
+        mLeftVolume,
+        mRightVolume,
+        mEnabled,
+        mMixer.sampleOffset(),
+        std::move(outputSampleOffsets)
+    };
+}
+
+void Apu::restoreState(State const& state) {
+    mHardware = state.hardware;
+    mNr51 = state.nr51;
+    mLeftVolume = state.leftVolume;
+    mRightVolume = state.rightVolume;
+    mEnabled = state.enabled;
+
+    mCycletime = 0;
+    mFrameTime = 0;
+    mMixTime = 0;
+    mTurboPhase = 0;
+    clearSamples();
+    mMixer.setSampleOffset(state.sampleOffset);
+    auto const offsets = std::min(mOutputs.size(), state.outputSampleOffsets.size());
+    for (size_t i = 0; i != offsets; ++i) {
+        mOutputs[i]->setSampleOffset(state.outputSampleOffsets[i]);
+    }
+    updateVolume();
+    resetTaps();
+}
+
+void Apu::setMixing(bool enabled) {
+    mMixing = enabled;
 }
 
 uint8_t Apu::readRegister(uint8_t reg, uint32_t autostep) {
@@ -242,10 +318,30 @@ void Apu::writeRegister(uint8_t reg, uint8_t value, uint32_t autostep) {
             auto leftVolDiff = mMixer.leftVolume() - oldVolumeLeft;
             auto rightVolDiff = mMixer.rightVolume() - oldVolumeRight;
 
+            if (!mMixing) {
+                break;
+            }
+
+            auto &mixer = targetMixer();
+            auto const& mix = mHardware.mix();
+            if (mixer.stemsEnabled()) {
+                // each stem gets the offset for its own channel
+                for (size_t i = 0; i != mix.size(); ++i) {
+                    auto mode = mix[i];
+                    auto output = mHardware.lastOutput(i) - 7.5f;
+                    mixer.mixDc(
+                        i,
+                        _internal::modePansLeft(mode) ? leftVolDiff * output : 0.0f,
+                        _internal::modePansRight(mode) ? rightVolDiff * output : 0.0f,
+                        mMixTime
+                    );
+                }
+                break;
+            }
+
             float dcLeft = 0.0f;
             float dcRight = 0.0f;
 
-            auto const& mix = mHardware.mix();
             for (size_t i = 0; i != mix.size(); ++i) {
                 auto mode = mix[i];
                 auto output = mHardware.lastOutput(i) - 7.5f;
@@ -258,7 +354,7 @@ void Apu::writeRegister(uint8_t reg, uint8_t value, uint32_t autostep) {
                 }
 
             }
-            mMixer.mixDc(dcLeft, dcRight, mCycletime);
+            mixer.mixDc(0, dcLeft, dcRight, mMixTime);
             break;
         }
         case REG_NR51: {
@@ -283,7 +379,16 @@ void Apu::writeRegister(uint8_t reg, uint8_t value, uint32_t autostep) {
 
                 panning >>= 1;
             }
-            mHardware.setMix(mix, mMixer, mCycletime);
+            if (mMixing) {
+                if (mTaps) {
+                    for (size_t i = 0; i != mix.size(); ++i) {
+                        (*mTaps)[i].setMode(mMixTime, mix[i]);
+                    }
+                }
+                mHardware.setMix(mix, targetMixer(), mMixer.volume(), mMixTime);
+            } else {
+                mHardware.setMix(mix);
+            }
 
             break;
         }
@@ -328,7 +433,7 @@ void Apu::writeRegister(uint8_t reg, uint8_t value, uint32_t autostep) {
             // this can only be done within a few clocks when CH3 accesses waveram, otherwise the write has no effect
             // this behavior was fixed for the CGB, so we can access waveram whenever
             if (auto &ch = mHardware.channel<2>(); !ch.isDacOn()) {
-                ch.waveram()[reg - REG_WAVERAM] = value;
+                ch.writeWaveram(reg - REG_WAVERAM, value);
             }
             // ignore write if enabled
             break;
@@ -338,22 +443,119 @@ void Apu::writeRegister(uint8_t reg, uint8_t value, uint32_t autostep) {
 }
 
 void Apu::step(uint32_t cycles) {
-//    while (cycles) {
+    if (mTurbo == 1) {
+        synthesize(cycles);
+        return;
+    }
+
+    // synthesize the first slice of every period, skip the rest. The period
+    // is 64-bit since factor * slice can overflow 32 bits.
+    auto const period = (uint64_t)mTurboSlice * mTurbo;
+    while (cycles) {
+        uint32_t toStep;
+        if (mTurboPhase < mTurboSlice) {
+            toStep = (uint32_t)std::min<uint64_t>(cycles, mTurboSlice - mTurboPhase);
+            synthesize(toStep);
+        } else {
+            toStep = (uint32_t)std::min<uint64_t>(cycles, period - mTurboPhase);
+            if (mMixing) {
+                mHardware.skip(toStep);
+            } else {
+                mHardware.fastforward(toStep);
+            }
+            mCycletime += toStep;
+        }
+        mTurboPhase = (mTurboPhase + toStep) % period;
+        cycles -= toStep;
+    }
+}
+
+void Apu::synthesize(uint32_t cycles) {
+    if (!mMixing) {
+        mHardware.fastforward(cycles);
+        mCycletime += cycles;
+        mMixTime += cycles;
+        return;
+    }
+
+    auto &mixer = targetMixer();
+    // the mixer's synthesis picks the backend once per step
+    auto const backend = _internal::makeBackend(mixer.synthesis());
+
+    // the step is split where the buffers are full, so that the mixers
+    // never have to check for it
+    while (cycles) {
+        auto const toStep = std::min(cycles, cyclesAvailable());
+        if (toStep == 0) {
+            handleOverflow(cycles);
+            continue;
+        }
+
+        std::visit([&](auto backend) {
+            mHardware.run<decltype(backend)>(mixer, mMixer.volume(), mMixTime, toStep, mTaps.get());
+        }, backend);
+        mCycletime += toStep;
+        mMixTime += toStep;
+        cycles -= toStep;
+    }
+}
 
-//        // step hardware components to the beat of the sequencer's period
-//        uint32_t cyclesToStep = std::min(cycles, mSequencer.timer());
-//        mSequencer.step(cyclesToStep);
-//        mCf.ch1.step(mMixer, mPannings[0], mCycletime, cyclesToStep);
-//        mCf.ch2.step(mMixer, mPannings[1], mCycletime, cyclesToStep);
-//        mCf.ch3.step(mMixer, mPannings[2], mCycletime, cyclesToStep);
-//        mCf.ch4.step(mMixer, mPannings[3], mCycletime, cyclesToStep);
+uint32_t Apu::cyclesAvailable() const noexcept {
+    auto const& apu = mHost ? *mHost : *this;
+    auto cycles = apu.mMixer.cyclesAvailable(mMixTime);
+    for (auto const& output : apu.mOutputs) {
+        cycles = std::min(cycles, output->cyclesAvailable(mMixTime));
+    }
+    return cycles;
+}
+
+void Apu::handleOverflow(uint32_t cycles) {
+    if (mHost) {
+        // flushing would flush the host's frame at this Apu's cycle time
+        mHost->growOutputs(mMixTime, cycles);
+        return;
+    }
 
-//        // update cycle counters
-//        cycles -= cyclesToStep;
-//        mCycletime += cyclesToStep;
-//    }
-    mHardware.run(mMixer, mCycletime, cycles);
-    mCycletime += cycles;
+    auto flushOutput = [this](size_t index, _internal::Mixer &mixer) {
+        mixer.flush(mMixTime);
+        auto const samples = mixer.availableSamples();
+        if (mFlushBuffer.size() < samples * 2) {
+            mFlushBuffer.allocate(samples * 2);
+        }
+        mixer.readSamples(mFlushBuffer.get(), samples);
+        mSink(index, mFlushBuffer.get(), samples);
+    };
+
+    // without a sink there is nowhere to flush to, so grow instead of
+    // dropping the samples
+    auto const flush = mOverflowPolicy == OverflowPolicy::flush && mSink;
+    if (flush) {
+        flushOutput(0, mMixer);
+        for (size_t i = 0; i != mOutputs.size(); ++i) {
+            flushOutput(i + 1, *mOutputs[i]);
+        }
+    }
+
+    // growing is also the fallback for a buffer too small to hold anything
+    // after flushing
+    if (!flush || cyclesAvailable() == 0) {
+        growOutputs(mMixTime, cycles);
+    }
+}
+
+void Apu::growOutputs(uint32_t cycletime, uint32_t cycles) {
+    auto growOutput = [cycletime, cycles](_internal::Mixer &mixer) {
+        // at least double the size, to not grow on every step
+        auto const end = cycletime + cycles;
+        if (mixer.cyclesAvailable(cycletime) < cycles) {
+            mixer.growBuffer(std::max(mixer.samplesNeeded(end), mixer.bufferSize() * 2));
+        }
+    };
+
+    growOutput(mMixer);
+    for (auto &output : mOutputs) {
+        growOutput(*output);
+    }
 }
 
 void Apu::stepTo(uint32_t time) {
@@ -365,16 +567,113 @@ void Apu::stepTo(uint32_t time) {
 }
 
 void Apu::endFrame() {
-    mMixer.endFrame(mCycletime);
+    // a host ends the frame of its guests
+    if (!mHost) {
+        mMixer.endFrame(mMixTime);
+        for (auto &output : mOutputs) {
+            output->endFrame(mMixTime);
+        }
+    }
+    if (mTaps) {
+        auto const left = mLeftVolume / 8.0f;
+        auto const right = mRightVolume / 8.0f;
+        for (auto &tap : *mTaps) {
+            tap.endFrame(mMixTime, left, right);
+        }
+    }
+    mFrameTime += mCycletime;
     mCycletime = 0;
+    mMixTime = 0;
+}
+
+void Apu::run(uint64_t cycles) {
+    auto sendAll = [this]() {
+        sendBlocks(0, mMixer);
+        for (size_t i = 0; i != mOutputs.size(); ++i) {
+            sendBlocks(i + 1, *mOutputs[i]);
+        }
+    };
+
+    endFrame();
+    sendAll();
+    while (cycles) {
+        auto const toRun = (uint32_t)std::min(cycles, (uint64_t)streamFrameCycles());
+        step(toRun);
+        endFrame();
+        sendAll();
+        cycles -= toRun;
+    }
+}
+
+void Apu::runTo(uint64_t time) {
+    if (time > this->time()) {
+        run(time - this->time());
+    }
+}
+
+void Apu::setTurbo(unsigned factor, uint32_t sliceCycles) {
+    // 0 would be a division by zero in step
+    mTurbo = std::max(factor, 1u);
+    mTurboSlice = std::max(sliceCycles, (uint32_t)1);
+    mTurboPhase = 0;
+}
+
+unsigned Apu::turbo() const noexcept {
+    return mTurbo;
+}
+
+uint64_t Apu::time() const noexcept {
+    return mFrameTime + mCycletime;
+}
+
+void Apu::setBlockSize(size_t samples) {
+    mBlockSize = samples;
+    auto grow = [this, samples](_internal::Mixer &mixer) {
+        auto const frameSamples = (size_t)(streamFrameCycles() * (double)mixer.samplerate() / constants::CLOCK_SPEED<double>);
+        mixer.growBuffer(samples + frameSamples + 2);
+    };
+    grow(mMixer);
+    for (auto &output : mOutputs) {
+        grow(*output);
+    }
+    reserveFlushBuffer();
+}
+
+void Apu::sendBlocks(size_t index, _internal::Mixer &mixer) {
+    auto const block = mBlockSize ? mBlockSize : mixer.availableSamples();
+    if (block == 0) {
+        return;
+    }
+
+    if (mFlushBuffer.size() < block * 2) {
+        mFlushBuffer.allocate(block * 2);
+    }
+    while (mixer.availableSamples() >= block) {
+        mixer.readSamples(mFlushBuffer.get(), block);
+        if (mSink) {
+            mSink(index, mFlushBuffer.get(), block);
+        }
+    }
+}
+
+void Apu::reserveFlushBuffer() {
+    auto samples = mMixer.bufferSize();
+    for (auto const& output : mOutputs) {
+        samples = std::max(samples, output->bufferSize());
+    }
+    if (mFlushBuffer.size() < samples * 2) {
+        mFlushBuffer.allocate(samples * 2);
+    }
+}
+
+_internal::Mixer& Apu::targetMixer() noexcept {
+    return mHost ? mHost->mMixer : mMixer;
 }
 
 void Apu::updateVolume() {
     // apply global volume settings
-    auto leftVol = mLeftVolume * mVolumeStep;
-    auto rightVol = mRightVolume * mVolumeStep;
-    mMixer.setVolume(leftVol, rightVol);
-
+    // the outputs are mixed with the main mixer's volume
+    mMixer.setVolume(mLeftVolume * mVolumeStep, mRightVolume * mVolumeStep);
 }
 
 // Buffer stuff
@@ -387,8 +686,27 @@ size_t Apu::readSamples(float *dest, size_t samples) {
     return mMixer.readSamples(dest, samples);
 }
 
+size_t Apu::readStems(float *dest, std::array<float*, 4> const& stems, size_t samples) {
+    return mMixer.readStems(dest, stems, samples);
+}
+
+size_t Apu::readDeltas(float *dest, size_t samples) {
+    return mMixer.readDeltas(dest, samples);
+}
+
+void Apu::integrate(float *buf, size_t samples) {
+    mMixer.integrate(buf, samples);
+}
+
+void Apu::removeSamples(size_t samples) {
+    mMixer.removeSamples(samples);
+}
+
 void Apu::clearSamples() {
     mMixer.clear();
+    for (auto &output : mOutputs) {
+        output->clear();
+    }
 }
 
 void Apu::setVolume(float gain) {
@@ -407,10 +725,177 @@ void Apu::setSamplerate(unsigned samplerate) {
     }
 }
 
+void Apu::setRateRatio(double ratio) {
+    mMixer.setRateRatio(ratio);
+    // keep whatever the mixer accepted, for outputs added later
+    mRateRatio = mMixer.rateRatio();
+    for (auto &output : mOutputs) {
+        output->setRateRatio(mRateRatio);
+    }
+}
+
+void Apu::setFramePeriod(uint32_t cycles) {
+    mFramePeriod = cycles;
+    mMixer.setFramePeriod(cycles);
+    for (auto &output : mOutputs) {
+        output->setFramePeriod(cycles);
+    }
+}
+
+size_t Apu::samplesPerFrame(size_t output) const noexcept {
+    return output ? mOutputs[output - 1]->samplesPerFrame() : mMixer.samplesPerFrame();
+}
+
+uint32_t Apu::streamFrameCycles() const noexcept {
+    return mFramePeriod ? mFramePeriod : STREAM_FRAME_CYCLES;
+}
+
 void Apu::setBuffersize(size_t samples) {
     if (mBuffersize != samples) {
         mBuffersize = samples;
-        mMixer.setBuffer(samples);
+        if (!mHost) {
+            mMixer.setBuffer(samples);
+            reserveFlushBuffer();
+        }
+    }
+}
+
+bool Apu::isSilent() noexcept {
+    if (!mMixer.isIdle()) {
+        return false;
+    }
+    for (auto const& output : mOutputs) {
+        if (!output->isIdle()) {
+            return false;
+        }
+    }
+    return mHardware.isIdle();
+}
+
+void Apu::setKernel(size_t width, size_t phases) {
+    mKernelWidth = width;
+    mKernelPhases = phases;
+    mMixer.setKernel(width, phases);
+    for (auto &output : mOutputs) {
+        output->setKernel(width, phases);
+    }
+}
+
+void Apu::setKernelFormat(KernelFormat format) {
+    mKernelFormat = format;
+    mMixer.setKernelFormat(format);
+    for (auto &output : mOutputs) {
+        output->setKernelFormat(format);
+    }
+}
+
+void Apu::setSynthesis(Synthesis synthesis) {
+    mMixer.setSynthesis(synthesis);
+    for (auto &output : mOutputs) {
+        output->setSynthesis(synthesis);
+    }
+}
+
+void Apu::setOverflowPolicy(OverflowPolicy policy) {
+    mOverflowPolicy = policy;
+}
+
+void Apu::setSink(SampleSink sink) {
+    mSink = std::move(sink);
+}
+
+void Apu::setStems(bool enabled) {
+    mMixer.setStems(enabled);
+}
+
+void Apu::setMono(bool enabled) {
+    mMixer.setMono(enabled);
+    for (auto &output : mOutputs) {
+        output->setMono(enabled);
+    }
+}
+
+size_t Apu::addOutput(unsigned samplerate, size_t buffersizeInSamples) {
+    auto output = _internal::makeAllocated<_internal::Mixer>(*mAllocator, *mAllocator);
+    output->setBuffer(buffersizeInSamples);
+    output->setSamplerate(samplerate);
+    output->setKernel(mKernelWidth, mKernelPhases);
+    output->setKernelFormat(mKernelFormat);
+    output->setSynthesis(mMixer.synthesis());
+    output->setMono(mMixer.monoEnabled());
+    output->setRateRatio(mRateRatio);
+    output->setFramePeriod(mFramePeriod);
+
+    // append to the end of the chain, the output only receives what is
+    // mixed from now on
+    auto &last = mOutputs.empty() ? mMixer : *mOutputs.back();
+    last.setNext(output.get());
+    mOutputs.push_back(std::move(output));
+    reserveFlushBuffer();
+    return mOutputs.size();
+}
+
+void Apu::clearOutputs() {
+    mMixer.setNext(nullptr);
+    mOutputs.clear();
+}
+
+size_t Apu::outputs() const noexcept {
+    return mOutputs.size() + 1;
+}
+
+void Apu::setHost(Apu *host) {
+    assert(host != this);
+    assert(host == nullptr || host->mHost == nullptr);
+
+    if (host == mHost) {
+        return;
+    }
+
+    mHost = host;
+    if (host) {
+        // only the volume of the own mixer is used while mixing into a host
+        mMixer.releaseBuffer();
+        mFlushBuffer.reset();
+    } else {
+        mMixer.setBuffer(mBuffersize);
+        reserveFlushBuffer();
+    }
+}
+
+Apu* Apu::host() const noexcept {
+    return mHost;
+}
+
+size_t Apu::availableSamples(size_t output) {
+    return output ? mOutputs[output - 1]->availableSamples() : mMixer.availableSamples();
+}
+
+size_t Apu::readSamples(size_t output, float *dest, size_t samples) {
+    return output ? mOutputs[output - 1]->readSamples(dest, samples) : mMixer.readSamples(dest, samples);
+}
+
+void Apu::setTaps(bool enabled) {
+    if (enabled) {
+        if (!mTaps) {
+            mTaps = _internal::makeAllocated<_internal::ChannelTaps>(*mAllocator);
+            resetTaps();
+        }
+    } else {
+        mTaps.reset();
+    }
+}
+
+_internal::Tap const& Apu::tap(size_t channel) const noexcept {
+    return (*mTaps)[channel];
+}
+
+void Apu::resetTaps() noexcept {
+    if (mTaps) {
+        auto const& mix = mHardware.mix();
+        for (size_t i = 0; i != mix.size(); ++i) {
+            (*mTaps)[i].reset(mHardware.lastOutput(i), mix[i]);
+        }
     }
 }
 
@@ -0,0 +1,318 @@
+
+#include "gbapu_render.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+namespace gbapu {
+
+namespace {
+
+constexpr uint32_t UNKNOWN_SIZE = 0xFFFFFFFF;
+
+#pragma pack(push, 1)
+
+//
+// Header for wav files, same layout as the demos' Wav.hpp. The fact chunk is
+// only required for float samples but is allowed for integer PCM too.
+//
+struct WavHeader {
+    // RIFF chunk
+    char riffId[4];
+    uint32_t chunkSize;         // file size - 8
+    char waveId[4];
+    // fmt subchunk
+    char fmtId[4];
+    uint32_t fmtChunkSize;
+    uint16_t fmtTag;            // 0x1 for PCM, 0x3 for IEEE_FLOAT
+    uint16_t fmtChannels;
+    uint32_t fmtSampleRate;
+    uint32_t fmtAvgBytesPerSec;
+    uint16_t fmtBlockAlign;
+    uint16_t fmtBitsPerSample;
+    uint16_t fmtCbSize;
+    // fact subchunk
+    char factId[4];
+    uint32_t factChunkSize;
+    uint32_t factSampleCount;   // frames in the data chunk
+    // data subchunk
+    char dataId[4];
+    uint32_t dataChunkSize;
+};
+
+#pragma pack(pop)
+
+//
+// Conversions from the float samples into a block. These are plain loops
+// over contiguous data so the compiler can vectorize them, the clamps are
+// ternaries on values which become min/max instructions (see CMakeLists.txt
+// for the flags this needs).
+//
+
+void convert(float const* in, float *out, size_t count) {
+    std::memcpy(out, in, count * sizeof(float));
+}
+
+void convert(float const* in, int16_t *out, size_t count) {
+    for (size_t i = 0; i != count; ++i) {
+        auto sample = in[i];
+        // NaN fails every comparison, so it would pass the clamps and its
+        // conversion to an integer is undefined. It is silenced instead.
+        sample = sample == sample ? sample : 0.0f;
+        sample = sample < -1.0f ? -1.0f : sample;
+        sample = sample > 1.0f ? 1.0f : sample;
+        sample *= 32767.0f;
+        // round half away from zero
+        out[i] = (int16_t)(int32_t)(sample + std::copysign(0.5f, sample));
+    }
+}
+
+}
+
+// ============================================================= AudioWriter ===
+
+AudioWriter::AudioWriter(
+    std::string const& path,
+    unsigned samplerate,
+    unsigned channels,
+    SampleFormat format,
+    Container container,
+    size_t blockSize
+) :
+    AudioWriter(
+        path == "-" ? stdout : std::fopen(path.c_str(), "wb"),
+        path != "-",
+        samplerate,
+        channels,
+        format,
+        container,
+        blockSize
+    )
+{
+}
+
+AudioWriter::AudioWriter(
+    std::FILE *stream,
+    unsigned samplerate,
+    unsigned channels,
+    SampleFormat format,
+    Container container,
+    size_t blockSize
+) :
+    AudioWriter(stream, false, samplerate, channels, format, container, blockSize)
+{
+}
+
+AudioWriter::AudioWriter(
+    std::FILE *stream,
+    bool owned,
+    unsigned samplerate,
+    unsigned channels,
+    SampleFormat format,
+    Container container,
+    size_t blockSize
+) :
+    mStream(stream),
+    mOwned(owned),
+    mSamplerate(samplerate),
+    mChannels(std::max(channels, 1u)),
+    mFormat(format),
+    mContainer(container),
+    mSampleSize(format == SampleFormat::f32 ? sizeof(float) : sizeof(int16_t)),
+    // whole frames only, so a frame never straddles two blocks
+    mBlockSize(std::max(blockSize / (mSampleSize * mChannels), (size_t)1) * mSampleSize * mChannels),
+    mBlocks{ std::make_unique<char[]>(mBlockSize), std::make_unique<char[]>(mBlockSize) },
+    mFront(mBlocks[0].get()),
+    mFrontSize(0),
+    mFrames(0),
+    mMutex(),
+    mCond(),
+    mPending(nullptr),
+    mPendingSize(0),
+    mFailed(stream == nullptr),
+    mQuit(false),
+    mClosed(stream == nullptr),
+    mThread()
+{
+    if (mStream == nullptr) {
+        return;
+    }
+
+#ifdef _WIN32
+    if (mStream == stdout) {
+        _setmode(_fileno(stdout), _O_BINARY);
+    }
+#endif
+    if (mOwned) {
+        // writes are already in large blocks, skip the stdio buffer
+        std::setvbuf(mStream, nullptr, _IONBF, 0);
+    }
+
+    if (mContainer == Container::wav) {
+        writeHeader(UNKNOWN_SIZE);
+    }
+    mThread = std::thread(&AudioWriter::ioMain, this);
+}
+
+AudioWriter::~AudioWriter() {
+    close();
+}
+
+void AudioWriter::write(float const* samples, size_t count) {
+    if (mClosed) {
+        return;
+    }
+
+    auto const frameSize = mSampleSize * mChannels;
+    mFrames += count;
+    while (count) {
+        auto const toWrite = std::min(count, (mBlockSize - mFrontSize) / frameSize);
+        auto const values = toWrite * mChannels;
+        if (mFormat == SampleFormat::f32) {
+            convert(samples, reinterpret_cast<float*>(mFront + mFrontSize), values);
+        } else {
+            convert(samples, reinterpret_cast<int16_t*>(mFront + mFrontSize), values);
+        }
+        samples += values;
+        mFrontSize += toWrite * frameSize;
+        count -= toWrite;
+
+        if (mFrontSize == mBlockSize) {
+            submit();
+        }
+    }
+}
+
+RenderSink AudioWriter::sink() {
+    return [this](float const* samples, size_t count) {
+        write(samples, count);
+    };
+}
+
+bool AudioWriter::close() {
+    if (mClosed) {
+        return good();
+    }
+    mClosed = true;
+
+    if (mFrontSize) {
+        submit();
+    }
+    {
+        std::unique_lock lock(mMutex);
+        mCond.wait(lock, [this]() { return mPending == nullptr; });
+        mQuit = true;
+    }
+    mCond.notify_all();
+    mThread.join();
+
+    // patch the sizes if we can seek back to the header, pipes keep the
+    // unknown sizes
+    if (mContainer == Container::wav && !mFailed && std::fseek(mStream, 0, SEEK_SET) == 0) {
+        writeHeader(mFrames);
+        std::fseek(mStream, 0, SEEK_END);
+    }
+
+    if (std::fflush(mStream) != 0) {
+        mFailed = true;
+    }
+    if (mOwned && std::fclose(mStream) != 0) {
+        mFailed = true;
+    }
+    mStream = nullptr;
+    return good();
+}
+
+bool AudioWriter::good() const noexcept {
+    return !mFailed;
+}
+
+uint64_t AudioWriter::frames() const noexcept {
+    return mFrames;
+}
+
+unsigned AudioWriter::channels() const noexcept {
+    return mChannels;
+}
+
+SampleFormat AudioWriter::format() const noexcept {
+    return mFormat;
+}
+
+void AudioWriter::writeHeader(uint64_t frames) {
+    auto const blockAlign = (uint32_t)(mSampleSize * mChannels);
+    // sizes that do not fit in the header are left unknown
+    auto const dataSize = frames * blockAlign;
+    auto const known = dataSize <= UNKNOWN_SIZE - sizeof(WavHeader);
+
+    WavHeader header = {
+        {'R', 'I', 'F', 'F'},
+        known ? (uint32_t)(dataSize + sizeof(WavHeader) - 8) : UNKNOWN_SIZE,
+        {'W', 'A', 'V', 'E'},
+        {'f', 'm', 't', ' '},
+        18,
+        (uint16_t)(mFormat == SampleFormat::f32 ? 0x3 : 0x1),
+        (uint16_t)mChannels,
+        mSamplerate,
+        mSamplerate * blockAlign,
+        (uint16_t)blockAlign,
+        (uint16_t)(mSampleSize * 8),
+        0,
+        {'f', 'a', 'c', 't'},
+        4,
+        known ? (uint32_t)frames : UNKNOWN_SIZE,
+        {'d', 'a', 't', 'a'},
+        known ? (uint32_t)dataSize : UNKNOWN_SIZE
+    };
+    if (std::fwrite(&header, sizeof(header), 1, mStream) != 1) {
+        mFailed = true;
+    }
+}
+
+void AudioWriter::submit() {
+    {
+        std::unique_lock lock(mMutex);
+        mCond.wait(lock, [this]() { return mPending == nullptr; });
+        mPending = mFront;
+        mPendingSize = mFrontSize;
+    }
+    mCond.notify_all();
+
+    mFront = mFront == mBlocks[0].get() ? mBlocks[1].get() : mBlocks[0].get();
+    mFrontSize = 0;
+}
+
+void AudioWriter::ioMain() {
+    for (;;) {
+        char const* block;
+        size_t size;
+        {
+            std::unique_lock lock(mMutex);
+            mCond.wait(lock, [this]() { return mQuit || mPending != nullptr; });
+            if (mPending == nullptr) {
+                return;
+            }
+            block = mPending;
+            size = mPendingSize;
+        }
+
+        auto const written = std::fwrite(block, 1, size, mStream);
+
+        {
+            std::lock_guard lock(mMutex);
+            if (written != size) {
+                mFailed = true;
+            }
+            mPending = nullptr;
+        }
+        mCond.notify_all();
+    }
+}
+
+}
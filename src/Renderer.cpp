@@ -0,0 +1,338 @@
+
+#include "gbapu_render.hpp"
+
+#include <algorithm>
+
+namespace gbapu {
+
+namespace _internal {
+
+// ============================================================== ThreadPool ===
+
+ThreadPool::ThreadPool(unsigned threads) :
+    mSize(threads ? threads : std::max(1u, std::thread::hardware_concurrency())),
+    mQueues(std::make_unique<Queue[]>(mSize)),
+    mThreads(),
+    mMutex(),
+    mWorkReady(),
+    mWorkDone(),
+    mTask(nullptr),
+    mGeneration(0),
+    mBusy(0),
+    mQuit(false),
+    mError(),
+    mFailed(false)
+{
+    mThreads.reserve(mSize);
+    for (unsigned i = 0; i != mSize; ++i) {
+        mThreads.emplace_back(&ThreadPool::workerMain, this, i);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard lock(mMutex);
+        mQuit = true;
+    }
+    mWorkReady.notify_all();
+    for (auto &thread : mThreads) {
+        thread.join();
+    }
+}
+
+unsigned ThreadPool::size() const noexcept {
+    return mSize;
+}
+
+void ThreadPool::run(size_t count, Task const& task) {
+    if (count == 0) {
+        return;
+    }
+
+    // deal out the indices round-robin, so each worker starts with an even share
+    for (size_t i = 0; i != count; ++i) {
+        auto &queue = mQueues[i % mSize];
+        std::lock_guard lock(queue.mutex);
+        queue.items.push_back(i);
+    }
+
+    std::unique_lock lock(mMutex);
+    mTask = &task;
+    mBusy = mSize;
+    ++mGeneration;
+    mWorkReady.notify_all();
+    mWorkDone.wait(lock, [this]() { return mBusy == 0; });
+    mTask = nullptr;
+
+    // rethrow on the calling thread, a worker would terminate instead
+    if (mError) {
+        mFailed = false;
+        std::rethrow_exception(std::exchange(mError, nullptr));
+    }
+}
+
+void ThreadPool::workerMain(unsigned worker) {
+    uint64_t generation = 0;
+    for (;;) {
+        Task const* task;
+        {
+            std::unique_lock lock(mMutex);
+            mWorkReady.wait(lock, [&]() { return mQuit || mGeneration != generation; });
+            if (mQuit) {
+                return;
+            }
+            generation = mGeneration;
+            task = mTask;
+        }
+
+        size_t index;
+        while (next(worker, index)) {
+            if (mFailed.load(std::memory_order_relaxed)) {
+                // drain the rest of the batch so the queues start empty
+                continue;
+            }
+            try {
+                (*task)(index, worker);
+            } catch (...) {
+                std::lock_guard lock(mMutex);
+                if (!mError) {
+                    mError = std::current_exception();
+                }
+                mFailed = true;
+            }
+        }
+
+        {
+            std::lock_guard lock(mMutex);
+            if (--mBusy == 0) {
+                mWorkDone.notify_one();
+            }
+        }
+    }
+}
+
+bool ThreadPool::next(unsigned worker, size_t &index) {
+    {
+        auto &own = mQueues[worker];
+        std::lock_guard lock(own.mutex);
+        if (!own.items.empty()) {
+            index = own.items.front();
+            own.items.pop_front();
+            return true;
+        }
+    }
+
+    // own queue is empty, steal from the back of another worker's queue
+    for (unsigned i = 1; i < mSize; ++i) {
+        auto &victim = mQueues[(worker + i) % mSize];
+        std::lock_guard lock(victim.mutex);
+        if (!victim.items.empty()) {
+            index = victim.items.back();
+            victim.items.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+} // gbapu::_internal
+
+// ============================================================= RenderStats ===
+
+double RenderStats::ratio() const noexcept {
+    if (elapsed.count() == 0) {
+        return 0.0;
+    }
+    auto const audioSeconds = cycles / constants::CLOCK_SPEED<double>;
+    return audioSeconds / std::chrono::duration<double>(elapsed).count();
+}
+
+double RenderStats::samplesPerSecond() const noexcept {
+    if (elapsed.count() == 0) {
+        return 0.0;
+    }
+    return samples / std::chrono::duration<double>(elapsed).count();
+}
+
+// ================================================================ Renderer ===
+
+Renderer::Renderer(unsigned samplerate, unsigned threads) :
+    mSamplerate(samplerate),
+    // worst case number of samples in a frame, plus one for the fractional
+    // carry-over and one for a DC offset mixed at the end of the frame
+    mSamplesPerFrame((size_t)(CYCLES_PER_FRAME * (double)samplerate / constants::CLOCK_SPEED<double>) + 2),
+    mPool(threads),
+    mWorkers(mPool.size()),
+    mSeeker(std::make_unique<Apu>(mSamplerate, mSamplesPerFrame)),
+    mSegmentBuffers(mPool.size() * 2)
+{
+    for (auto &worker : mWorkers) {
+        worker.apu = std::make_unique<Apu>(mSamplerate, mSamplesPerFrame);
+        worker.frameBuf = std::make_unique<float[]>(mSamplesPerFrame * 2);
+    }
+}
+
+Renderer::~Renderer() = default;
+
+unsigned Renderer::samplerate() const noexcept {
+    return mSamplerate;
+}
+
+unsigned Renderer::threads() const noexcept {
+    return mPool.size();
+}
+
+RenderStats Renderer::render(std::vector<RenderJob> const& jobs) {
+    for (auto &worker : mWorkers) {
+        worker.cycles = 0;
+        worker.samples = 0;
+    }
+
+    auto const startTime = std::chrono::steady_clock::now();
+    mPool.run(jobs.size(), [&](size_t index, unsigned worker) {
+        renderJob(jobs[index], mWorkers[worker]);
+    });
+
+    RenderStats stats;
+    stats.elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - startTime
+    );
+    stats.jobs = jobs.size();
+    for (auto const& worker : mWorkers) {
+        stats.cycles += worker.cycles;
+        stats.samples += worker.samples;
+    }
+    return stats;
+}
+
+RenderStats Renderer::renderSegmented(RenderJob const& job, size_t framesPerSegment) {
+    framesPerSegment = std::max(framesPerSegment, (size_t)1);
+
+    auto const startTime = std::chrono::steady_clock::now();
+
+    auto const frames = (job.duration + CYCLES_PER_FRAME - 1) / CYCLES_PER_FRAME;
+    std::vector<Segment> segments((size_t)((frames + framesPerSegment - 1) / framesPerSegment));
+    for (size_t i = 0; i != segments.size(); ++i) {
+        auto &segment = segments[i];
+        segment.startFrame = i * framesPerSegment;
+        segment.endFrame = std::min(segment.startFrame + framesPerSegment, frames);
+        // all segments but the first pre-roll the frame before it
+        segment.firstFrame = i ? segment.startFrame - 1 : 0;
+        segment.samples = 0;
+    }
+
+    // pass one, run the script without mixing and save the state of each
+    // segment's first frame
+    auto &seeker = *mSeeker;
+    seeker.reset();
+    seeker.setMixing(false);
+
+    auto nextSave = segments.begin();
+    auto saveStates = [&](uint64_t frame) {
+        for (; nextSave != segments.end() && nextSave->firstFrame == frame; ++nextSave) {
+            nextSave->state = seeker.saveState();
+        }
+    };
+    saveStates(0);
+    runFrames(seeker, job, 0, frames, [&](uint64_t frame) {
+        auto samples = seeker.availableSamples();
+        seeker.removeSamples(samples);
+        segments[(size_t)(frame / framesPerSegment)].samples += samples;
+        saveStates(frame + 1);
+    });
+
+    // pass two, synthesize the segments in batches, integrating and sending
+    // each batch to the sink in order. The seeker is reused for integrating
+    // so that the filter state carries over between segments.
+    seeker.setMixing(true);
+    seeker.clearSamples();
+
+    RenderStats stats;
+    auto const batchSize = mSegmentBuffers.size();
+    for (size_t batch = 0; batch < segments.size(); batch += batchSize) {
+        auto const count = std::min(batchSize, segments.size() - batch);
+        mPool.run(count, [&](size_t index, unsigned worker) {
+            renderSegment(job, segments[batch + index], mSegmentBuffers[index], mWorkers[worker]);
+        });
+
+        for (size_t i = 0; i != count; ++i) {
+            auto &buf = mSegmentBuffers[i];
+            auto const samples = segments[batch + i].samples;
+            seeker.integrate(buf.data(), samples);
+            if (job.sink) {
+                job.sink(buf.data(), samples);
+            }
+            stats.samples += samples;
+        }
+    }
+
+    stats.elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - startTime
+    );
+    stats.jobs = 1;
+    stats.cycles = job.duration;
+    return stats;
+}
+
+void Renderer::renderJob(RenderJob const& job, Worker &worker) {
+    auto &apu = *worker.apu;
+    apu.reset();
+
+    runFrames(apu, job, 0, (job.duration + CYCLES_PER_FRAME - 1) / CYCLES_PER_FRAME, [&](uint64_t) {
+        auto samples = apu.readSamples(worker.frameBuf.get(), apu.availableSamples());
+        if (job.sink) {
+            job.sink(worker.frameBuf.get(), samples);
+        }
+        worker.samples += samples;
+    });
+
+    worker.cycles += job.duration;
+}
+
+void Renderer::runFrames(
+    Apu &apu,
+    RenderJob const& job,
+    uint64_t first,
+    uint64_t last,
+    FrameCallback const& callback
+) {
+    auto const& script = job.script;
+    uint64_t time = first * CYCLES_PER_FRAME;
+    auto iter = std::lower_bound(script.begin(), script.end(), time,
+        [](RegisterWrite const& write, uint64_t t) { return write.time < t; });
+
+    for (auto frame = first; frame != last; ++frame) {
+        auto const frameEnd = std::min(time + CYCLES_PER_FRAME, job.duration);
+
+        for (; iter != script.end() && iter->time < frameEnd; ++iter) {
+            apu.stepTo((uint32_t)(iter->time - time));
+            apu.writeRegister(iter->reg, iter->value, 0);
+        }
+        apu.stepTo((uint32_t)(frameEnd - time));
+        apu.endFrame();
+        callback(frame);
+
+        time = frameEnd;
+    }
+}
+
+void Renderer::renderSegment(RenderJob const& job, Segment const& segment, std::vector<float> &output, Worker &worker) {
+    auto &apu = *worker.apu;
+    apu.restoreState(segment.state);
+
+    output.resize(segment.samples * 2);
+    auto dest = output.data();
+    auto remaining = segment.samples;
+    runFrames(apu, job, segment.firstFrame, segment.endFrame, [&](uint64_t frame) {
+        if (frame < segment.startFrame) {
+            // pre-roll, only needed for the steps it mixes into the next frame
+            apu.removeSamples(apu.availableSamples());
+        } else {
+            auto samples = apu.readDeltas(dest, std::min(remaining, apu.availableSamples()));
+            dest += samples * 2;
+            remaining -= samples;
+        }
+    });
+}
+
+}
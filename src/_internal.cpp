@@ -114,6 +114,10 @@ uint8_t Envelope::volume() const noexcept {
     return mVolume;
 }
 
+bool Envelope::isChanging() const noexcept {
+    return mPeriod && (mAmplify ? mVolume < 0xF : mVolume > 0x0);
+}
+
 // =================================================================== Sweep ===
 
 Sweep::Sweep() :
@@ -273,6 +277,7 @@ void Channel::reset() noexcept {
     mEnabled = false;
     mFrequency = 0;
     mOutput = 0;
+    mTimer.restart();
 }
 
 void Channel::restart() noexcept {
@@ -288,17 +293,86 @@ constexpr uint16_t LFSR_INIT = 0x7FFF;
 
 constexpr uint32_t NOISE_DEFAULT_PERIOD = 8;
 
+constexpr uint16_t lfsrNext(uint16_t lfsr, bool halfWidth) {
+    // xor bits 1 and 0 of the lfsr
+    uint16_t result = (lfsr & 0x1) ^ ((lfsr >> 1) & 0x1);
+    // shift the register
+    lfsr >>= 1;
+    // set the resulting xor to bit 15 (feedback)
+    lfsr |= result << 14;
+    if (halfWidth) {
+        // 7-bit lfsr, set bit 7 with the result
+        lfsr &= ~0x40; // reset bit 7
+        lfsr |= result << 6; // set bit 7 result
+    }
+    return lfsr;
 }
 
-NoiseChannel::NoiseChannel(Envelope const& envelope) :
+constexpr size_t LFSR_PERIOD = 0x7FFF;      // period of the 15-bit sequence
+constexpr size_t LFSR7_PERIOD = 0x7F;       // period of the 7-bit sequence
+
+//
+// Lookup tables for the noise LFSR. Every nonzero 15-bit state is part of
+// the same maximal length sequence, so the LFSR can jump any number of clocks
+// with the state's position in the sequence. The runs tables have the number
+// of clocks until the output bit changes for each state, or 0 for the zero
+// state which never changes. In 7-bit mode, only the lower 7 bits determine
+// the output.
+//
+struct LfsrTables {
+    std::array<uint16_t, LFSR_PERIOD> sequence;
+    std::array<uint16_t, LFSR_PERIOD + 1> position;
+    std::array<uint8_t, LFSR_PERIOD + 1> runs;
+    std::array<uint8_t, LFSR7_PERIOD + 1> runs7;
+};
+
+LfsrTables const& lfsrTables() {
+    static LfsrTables const tables = []() {
+        LfsrTables t{};
+        uint16_t lfsr = LFSR_INIT;
+        for (size_t i = 0; i != LFSR_PERIOD; ++i) {
+            t.sequence[i] = lfsr;
+            t.position[lfsr] = (uint16_t)i;
+            lfsr = lfsrNext(lfsr, false);
+        }
+        assert(lfsr == LFSR_INIT);
+
+        auto runLength = [](uint16_t state, bool halfWidth) -> uint8_t {
+            auto const bit = state & 1;
+            for (uint8_t clocks = 1; clocks <= 16; ++clocks) {
+                state = lfsrNext(state, halfWidth);
+                if ((state & 1) != bit) {
+                    return clocks;
+                }
+            }
+            return 0;
+        };
+        for (size_t state = 0; state != t.runs.size(); ++state) {
+            t.runs[state] = runLength((uint16_t)state, false);
+        }
+        for (size_t state = 0; state != t.runs7.size(); ++state) {
+            t.runs7[state] = runLength((uint16_t)state, true);
+        }
+        return t;
+    }();
+    return tables;
+}
+
+}
+
+NoiseChannel::NoiseChannel() :
     Channel(NOISE_DEFAULT_PERIOD),
-    mEnvelope(envelope),
+    mEnvelope(),
     mValidScf(true),
     mHalfWidth(false),
     mLfsr(LFSR_INIT)
 {
 }
 
+Envelope& NoiseChannel::envelope() noexcept {
+    return mEnvelope;
+}
+
 void NoiseChannel::setNoise(uint8_t noisereg) noexcept {
     mFrequency = noisereg;
     // drf = "dividing ratio frequency", divisor, etc
@@ -323,13 +397,12 @@ void NoiseChannel::clock() noexcept {
 }
 
 void NoiseChannel::reset() noexcept {
+    timer().setPeriod(NOISE_DEFAULT_PERIOD);
     Channel::reset();
 
     mValidScf = true;
     mHalfWidth = false;
     mLfsr = LFSR_INIT;
-
-    timer().setPeriod(NOISE_DEFAULT_PERIOD);
 }
 
 void NoiseChannel::restart() noexcept {
@@ -339,28 +412,72 @@ void NoiseChannel::restart() noexcept {
 }
 
 void NoiseChannel::fastforward(uint32_t cycles) noexcept {
-
     auto clocks = timer().fastforward(cycles);
-    if (mValidScf) {
-        while (clocks) {
-            clockLfsr();
-            --clocks;
-        }
+    if (clocks) {
+        advance(clocks);
+    }
+}
+
+void NoiseChannel::prepareEdges() noexcept {
+    // edges are in a constant table, nothing to prepare
+}
+
+uint32_t NoiseChannel::clocksToChange() const noexcept {
+    if (!mValidScf) {
+        // no clocks
+        return 0;
+    }
+    auto const volume = mEnvelope.volume();
+    if (mOutput != (-((~mLfsr) & 1) & volume)) {
+        // the envelope changed the volume since the last clock, the next
+        // clock will update the output
+        return 1;
+    }
+    if (volume == 0) {
+        return 0;
+    }
+    auto const& tables = lfsrTables();
+    return mHalfWidth ? tables.runs7[mLfsr & LFSR7_PERIOD] : tables.runs[mLfsr];
+}
+
+void NoiseChannel::advance(uint32_t clocks) noexcept {
+    // the output is only updated when clocked, same as clock()
+    if (mValidScf && clocks) {
+        jumpLfsr(clocks);
         updateOutput();
     }
 }
 
+bool NoiseChannel::isOutputInvariant() const noexcept {
+    // no clocks with an invalid scf, otherwise each clock outputs 0 when the
+    // volume is 0. The envelope can only raise the volume at a sequencer
+    // event, which ends the run.
+    return clocksToChange() == 0;
+}
+
 void NoiseChannel::clockLfsr() noexcept {
-    // xor bits 1 and 0 of the lfsr
-    uint8_t result = (mLfsr & 0x1) ^ ((mLfsr >> 1) & 0x1);
-    // shift the register
-    mLfsr >>= 1;
-    // set the resulting xor to bit 15 (feedback)
-    mLfsr |= result << 14;
+    mLfsr = lfsrNext(mLfsr, mHalfWidth);
+}
+
+void NoiseChannel::jumpLfsr(uint32_t clocks) noexcept {
+    if (mLfsr == 0) {
+        // stuck, can only happen by switching to 7-bit mode when the lower
+        // 7 bits are all 0
+        return;
+    }
+
     if (mHalfWidth) {
-        // 7-bit lfsr, set bit 7 with the result
-        mLfsr &= ~0x40; // reset bit 7
-        mLfsr |= result << 6; // set bit 7 result
+        // after 8 clocks the upper bits only depend on the lower 7, so the
+        // entire state repeats every 127 clocks from then on
+        if (clocks > 8 + LFSR7_PERIOD) {
+            clocks = 8 + ((clocks - 8) % LFSR7_PERIOD);
+        }
+        while (clocks--) {
+            clockLfsr();
+        }
+    } else {
+        auto const& tables = lfsrTables();
+        mLfsr = tables.sequence[(tables.position[mLfsr] + clocks) % LFSR_PERIOD];
     }
 }
 
@@ -394,17 +511,43 @@ static constexpr uint32_t PULSE_DEFAULT_PERIOD = (2048 - 0) * PULSE_MULTIPLIER;
 #define setOutput() mOutput = (mDutyWaveform >> mDutyCounter) & 1
 #define dutyWaveform(duty) ((DUTY_MASK >> (duty << 3)) & 0xFF)
 
+//
+// For each duty and duty counter, the number of clocks until the duty
+// waveform changes. Every duty has two edges so this is never 0.
+//
+constexpr std::array<std::array<uint8_t, 8>, 4> makePulseEdges() {
+    std::array<std::array<uint8_t, 8>, 4> edges{};
+    for (unsigned duty = 0; duty != 4; ++duty) {
+        auto const waveform = dutyWaveform(duty);
+        for (unsigned counter = 0; counter != 8; ++counter) {
+            auto const bit = (waveform >> counter) & 1;
+            uint8_t clocks = 1;
+            while (((waveform >> ((counter + clocks) & 0x7)) & 1) == bit) {
+                ++clocks;
+            }
+            edges[duty][counter] = clocks;
+        }
+    }
+    return edges;
+}
+
+static constexpr auto PULSE_EDGES = makePulseEdges();
+
 }
 
-PulseChannel::PulseChannel(Envelope const& envelope) :
+PulseChannel::PulseChannel() :
     Channel(PULSE_DEFAULT_PERIOD),
-    mEnvelope(envelope),
+    mEnvelope(),
     mDuty(Duty75),
     mDutyWaveform(dutyWaveform(mDuty)),
     mDutyCounter(0)
 {
 }
 
+Envelope& PulseChannel::envelope() noexcept {
+    return mEnvelope;
+}
+
 uint8_t PulseChannel::duty() const noexcept {
     return mDuty;
 }
@@ -436,10 +579,34 @@ void PulseChannel::reset() noexcept {
 
 void PulseChannel::fastforward(uint32_t cycles) noexcept {
     auto clocks = timer().fastforward(cycles);
+    if (clocks) {
+        advance(clocks);
+    }
+}
+
+void PulseChannel::prepareEdges() noexcept {
+    // edges are in a constant table, nothing to prepare
+}
+
+uint32_t PulseChannel::clocksToChange() const noexcept {
+    auto const volume = mEnvelope.volume();
+    if (mOutput != (-((mDutyWaveform >> mDutyCounter) & 1) & volume)) {
+        // the envelope changed the volume since the last clock, the next
+        // clock will update the output
+        return 1;
+    }
+    return volume ? PULSE_EDGES[mDuty][mDutyCounter] : 0;
+}
+
+void PulseChannel::advance(uint32_t clocks) noexcept {
     mDutyCounter = (mDutyCounter + clocks) & 0x7;
     updateOutput();
 }
 
+bool PulseChannel::isOutputInvariant() const noexcept {
+    return clocksToChange() == 0;
+}
+
 void PulseChannel::updateOutput() noexcept {
     mOutput = -((mDutyWaveform >> mDutyCounter) & 1) & mEnvelope.volume();
 }
@@ -463,15 +630,28 @@ WaveChannel::WaveChannel() :
     mVolumeShift(0),
     mWaveIndex(0),
     mSampleBuffer(0),
-    mWaveram()
+    mWaveram(),
+    mSamples(),
+    mEdges(),
+    mEdgesDirty(false)
 {
     mWaveram.fill((uint8_t)0);
+    mSamples.fill((uint8_t)0);
+    mEdges.fill((uint8_t)0);
 }
 
-uint8_t* WaveChannel::waveram() noexcept {
+uint8_t const* WaveChannel::waveram() const noexcept {
     return mWaveram.data();
 }
 
+void WaveChannel::writeWaveram(size_t index, uint8_t value) noexcept {
+    mWaveram[index] = value;
+    // high nibble is played first
+    mSamples[index * 2] = value >> 4;
+    mSamples[index * 2 + 1] = value & 0xF;
+    mEdgesDirty = true;
+}
+
 uint8_t WaveChannel::volume() const noexcept {
     return mWaveVolume;
 }
@@ -492,6 +672,7 @@ void WaveChannel::setVolume(uint8_t volume) noexcept {
             mVolumeShift = 2;
             break;
     }
+    mEdgesDirty = true;
     updateOutput();
 }
 
@@ -510,6 +691,8 @@ void WaveChannel::reset() noexcept {
     mVolumeShift = 0;
     mWaveVolume = VolumeMute;
     mWaveram.fill((uint8_t)0);
+    mSamples.fill((uint8_t)0);
+    mEdgesDirty = true;
     mSampleBuffer = 0;
     mWaveIndex = 0;
     Channel::reset();
@@ -522,19 +705,63 @@ void WaveChannel::restart() noexcept {
 
 void WaveChannel::fastforward(uint32_t cycles) noexcept {
     auto clocks = timer().fastforward(cycles);
+    if (clocks) {
+        advance(clocks);
+    }
+}
+
+void WaveChannel::prepareEdges() noexcept {
+    if (!mEdgesDirty) {
+        return;
+    }
+    mEdgesDirty = false;
+
+    constexpr size_t count = std::tuple_size_v<decltype(mSamples)>;
+
+    // find an edge, a position whose next sample is different
+    auto sample = [this](size_t index) {
+        return mSamples[index & (count - 1)] >> mVolumeShift;
+    };
+    size_t edge = 0;
+    while (edge != count && sample(edge) == sample(edge + 1)) {
+        ++edge;
+    }
+    if (edge == count) {
+        // the output is constant, no edges
+        mEdges.fill((uint8_t)0);
+        return;
+    }
+
+    // walk backwards from the edge, counting the distance to the next edge
+    mEdges[edge] = 1;
+    for (size_t i = 1; i != count; ++i) {
+        auto const pos = (edge - i) & (count - 1);
+        auto const next = (pos + 1) & (count - 1);
+        mEdges[pos] = sample(pos) != sample(next) ? 1 : mEdges[next] + 1;
+    }
+}
+
+uint32_t WaveChannel::clocksToChange() const noexcept {
+    if (mOutput != (mSamples[mWaveIndex] >> mVolumeShift)) {
+        // the sample buffer is stale, wave RAM was written since the last
+        // clock, the next clock will update the output
+        return 1;
+    }
+    return mEdges[mWaveIndex];
+}
+
+void WaveChannel::advance(uint32_t clocks) noexcept {
     mWaveIndex = (mWaveIndex + clocks) & 0x1F;
     updateSampleBuffer();
 }
 
+bool WaveChannel::isOutputInvariant() const noexcept {
+    // volume is muted or every sample in wave RAM is the same
+    return clocksToChange() == 0;
+}
+
 void WaveChannel::updateSampleBuffer() noexcept {
-    mSampleBuffer = mWaveram[mWaveIndex >> 1];
-    if (mWaveIndex & 1) {
-        // odd number, low nibble
-        mSampleBuffer &= 0xF;
-    } else {
-        // even number, high nibble
-        mSampleBuffer >>= 4;
-    }
+    mSampleBuffer = mSamples[mWaveIndex];
     updateOutput();
 }
 
@@ -612,6 +839,99 @@ uint32_t Sequencer::cyclesToNextTrigger() const noexcept {
     return mTimer.counter();
 }
 
+// ===================================================================== Tap ===
+
+Tap::Tap() :
+    mTransitions(),
+    mCount(),
+    mInitial(),
+    mRecording(0),
+    mCycletime(0),
+    mLevel(0),
+    mMode(MixMode::mute),
+    mOverflowed(false),
+    mEnergy(),
+    mPeakLevel(),
+    mLastOverflowed(false),
+    mPeak(),
+    mRms()
+{
+}
+
+void Tap::reset(uint8_t output, MixMode mode) noexcept {
+    mCount.fill(0);
+    mInitial.fill(output);
+    mRecording = 0;
+    mCycletime = 0;
+    mLevel = output;
+    mMode = mode;
+    mOverflowed = false;
+    mEnergy.fill(0);
+    mPeakLevel.fill(0);
+    mLastOverflowed = false;
+    mPeak.fill(0.0f);
+    mRms.fill(0.0f);
+}
+
+void Tap::setMode(uint32_t cycletime, MixMode mode) noexcept {
+    advance(cycletime);
+    mMode = mode;
+}
+
+void Tap::endFrame(uint32_t cycletime, float leftScale, float rightScale) noexcept {
+    advance(cycletime);
+
+    std::array<float, 2> const scales = { leftScale / 15.0f, rightScale / 15.0f };
+    for (size_t i = 0; i != scales.size(); ++i) {
+        mPeak[i] = mPeakLevel[i] * scales[i];
+        mRms[i] = cycletime ? std::sqrt((float)mEnergy[i] / cycletime) * scales[i] : 0.0f;
+    }
+    mLastOverflowed = mOverflowed;
+
+    // swap buffers and start the next frame
+    mRecording ^= 1;
+    mCount[mRecording] = 0;
+    mInitial[mRecording] = mLevel;
+    mCycletime = 0;
+    mOverflowed = false;
+    mEnergy.fill(0);
+    mPeakLevel.fill(0);
+}
+
+uint8_t Tap::initialOutput() const noexcept {
+    return mInitial[mRecording ^ 1];
+}
+
+Tap::Transition const* Tap::transitions() const noexcept {
+    return mTransitions[mRecording ^ 1].data();
+}
+
+size_t Tap::transitionCount() const noexcept {
+    return mCount[mRecording ^ 1];
+}
+
+bool Tap::overflowed() const noexcept {
+    return mLastOverflowed;
+}
+
+float Tap::peak(size_t terminal) const noexcept {
+    return mPeak[terminal];
+}
+
+float Tap::rms(size_t terminal) const noexcept {
+    return mRms[terminal];
+}
+
+// ============================================================== VolumeStep ===
+
+VolumeStep::VolumeStep(float leftVolume, float rightVolume) noexcept :
+    left(leftVolume),
+    right(rightVolume),
+    // the average of the terminals the mode pans to
+    mono{ 0.0f, rightVolume * 0.5f, leftVolume * 0.5f, (leftVolume + rightVolume) * 0.5f }
+{
+}
+
 // ================================================================ Hardware ===
 
 Hardware::Hardware() :
@@ -621,15 +941,9 @@ Hardware::Hardware() :
         LengthCounter(256),
         LengthCounter(64)
     },
-    mEnvelopes(),
     mSweep(),
     mSequencer(),
-    mChannels{
-        PulseChannel(mEnvelopes[0]),
-        PulseChannel(mEnvelopes[1]),
-        WaveChannel(),
-        NoiseChannel(mEnvelopes[2])
-    },
+    mChannels(),
     mMix(),
     mLastOutputs()
 {
@@ -637,7 +951,9 @@ Hardware::Hardware() :
 
 void Hardware::reset() {
     std::for_each(mLengthCounters.begin(), mLengthCounters.end(), std::mem_fn(&LengthCounter::reset));
-    std::for_each(mEnvelopes.begin(), mEnvelopes.end(), std::mem_fn(&Envelope::reset));
+    envelope<0>().reset();
+    envelope<1>().reset();
+    envelope<3>().reset();
     mSweep.reset();
     mSequencer.reset();
     std::get<0>(mChannels).reset();
@@ -650,7 +966,9 @@ void Hardware::reset() {
 }
 
 void Hardware::clockEnvelopes() noexcept {
-    std::for_each(mEnvelopes.begin(), mEnvelopes.end(), std::mem_fn(&Envelope::clock));
+    envelope<0>().clock();
+    envelope<1>().clock();
+    envelope<3>().clock();
 }
 
 void Hardware::clockLengthCounters() noexcept {
@@ -668,7 +986,7 @@ Sweep& Hardware::sweep() noexcept {
     return mSweep;
 }
 
-void Hardware::setMix(const ChannelMix &mix, Mixer &mixer, uint32_t cycletime) noexcept {
+void Hardware::setMix(const ChannelMix &mix, Mixer &mixer, VolumeStep const& volume, uint32_t cycletime) noexcept {
 
     // check for changes in the mix
     for (size_t i = 0; i < mMix.size(); ++i) {
@@ -682,20 +1000,20 @@ void Hardware::setMix(const ChannelMix &mix, Mixer &mixer, uint32_t cycletime) n
             float dcRight = 0.0f;
             auto const level = 7.5f - mLastOutputs[i];
             if (changes & MIX_LEFT) {
-                dcLeft = mixer.leftVolume() * level;
+                dcLeft = volume.left * level;
                 if (modePansLeft(next)) {
                     dcLeft = -dcLeft;
                 }
             }
 
             if (changes & MIX_RIGHT) {
-                dcRight = mixer.rightVolume() * level;
+                dcRight = volume.right * level;
                 if (modePansRight(next)) {
                     dcRight = -dcRight;
                 }
             }
 
-            mixer.mixDc(dcLeft, dcRight, cycletime);
+            mixer.mixDc(i, dcLeft, dcRight, cycletime);
         }
     }
 
@@ -703,6 +1021,10 @@ void Hardware::setMix(const ChannelMix &mix, Mixer &mixer, uint32_t cycletime) n
     mMix = mix;
 }
 
+void Hardware::setMix(ChannelMix const& mix) noexcept {
+    mMix = mix;
+}
+
 ChannelMix const& Hardware::mix() const noexcept {
     return mMix;
 }
@@ -711,14 +1033,61 @@ uint8_t Hardware::lastOutput(size_t channel) const noexcept {
     return mLastOutputs[channel];
 }
 
-void Hardware::run(Mixer &mixer, uint32_t cycletime, uint32_t cycles) noexcept {
+namespace {
+
+//
+// True if the channel's envelope will change its volume at a later
+// sequencer event, the wave channel has no envelope
+//
+template <class Channel>
+bool isEnvelopeChanging(Channel &ch) noexcept {
+    if constexpr (std::is_same_v<Channel, WaveChannel>) {
+        (void)ch;
+        return false;
+    } else {
+        return ch.envelope().isChanging();
+    }
+}
+
+}
+
+bool Hardware::isIdle() noexcept {
+    auto idle = [this](size_t index, auto &ch) {
+        if (mMix[index] == MixMode::mute) {
+            return true;
+        }
+        if (!ch.isDacOn() || !ch.isEnabled()) {
+            // silenced on the next run if not already
+            return mLastOutputs[index] == 0;
+        }
+        if (isEnvelopeChanging(ch)) {
+            return false;
+        }
+        ch.prepareEdges();
+        return ch.output() == mLastOutputs[index] && ch.isOutputInvariant();
+    };
+
+    return idle(0, std::get<0>(mChannels)) &&
+           idle(1, std::get<1>(mChannels)) &&
+           idle(2, std::get<2>(mChannels)) &&
+           idle(3, std::get<3>(mChannels));
+}
+
+template <class Backend>
+void Hardware::run(Mixer &mixer, VolumeStep const& volume, uint32_t cycletime, uint32_t cycles, ChannelTaps *taps) noexcept {
+    assert(mixer.synthesis() == Backend::synthesis);
+
+    auto tap = [taps](size_t index) -> Tap* {
+        return taps ? &(*taps)[index] : nullptr;
+    };
+
     while (cycles) {
         // step components to the beat of the sequencer
         auto toStep = std::min(cycles, mSequencer.cyclesToNextTrigger());
-        runChannel(0, std::get<0>(mChannels), mixer, cycletime, toStep);
-        runChannel(1, std::get<1>(mChannels), mixer, cycletime, toStep);
-        runChannel(2, std::get<2>(mChannels), mixer, cycletime, toStep);
-        runChannel(3, std::get<3>(mChannels), mixer, cycletime, toStep);
+        runChannel<Backend>(0, std::get<0>(mChannels), mixer, volume, tap(0), cycletime, toStep);
+        runChannel<Backend>(1, std::get<1>(mChannels), mixer, volume, tap(1), cycletime, toStep);
+        runChannel<Backend>(2, std::get<2>(mChannels), mixer, volume, tap(2), cycletime, toStep);
+        runChannel<Backend>(3, std::get<3>(mChannels), mixer, volume, tap(3), cycletime, toStep);
         mSequencer.run(*this, toStep);
 
         cycletime += toStep;
@@ -726,30 +1095,88 @@ void Hardware::run(Mixer &mixer, uint32_t cycletime, uint32_t cycles) noexcept {
     }
 }
 
+template void Hardware::run<BlepBackend>(Mixer &mixer, VolumeStep const& volume, uint32_t cycletime, uint32_t cycles, ChannelTaps *taps) noexcept;
+template void Hardware::run<LinearBackend>(Mixer &mixer, VolumeStep const& volume, uint32_t cycletime, uint32_t cycles, ChannelTaps *taps) noexcept;
+template void Hardware::run<NearestBackend>(Mixer &mixer, VolumeStep const& volume, uint32_t cycletime, uint32_t cycles, ChannelTaps *taps) noexcept;
+template void Hardware::run<OversampledBackend>(Mixer &mixer, VolumeStep const& volume, uint32_t cycletime, uint32_t cycles, ChannelTaps *taps) noexcept;
+
+AnyBackend makeBackend(Synthesis synthesis) noexcept {
+    switch (synthesis) {
+        case Synthesis::linear:
+            return LinearBackend();
+        case Synthesis::nearest:
+            return NearestBackend();
+        case Synthesis::oversampled:
+            return OversampledBackend();
+        default:
+            return BlepBackend();
+    }
+}
+
+void Hardware::fastforward(uint32_t cycles) noexcept {
+    while (cycles) {
+        auto toStep = std::min(cycles, mSequencer.cyclesToNextTrigger());
+        fastforwardChannel(0, std::get<0>(mChannels), toStep);
+        fastforwardChannel(1, std::get<1>(mChannels), toStep);
+        fastforwardChannel(2, std::get<2>(mChannels), toStep);
+        fastforwardChannel(3, std::get<3>(mChannels), toStep);
+        mSequencer.run(*this, toStep);
+
+        cycles -= toStep;
+    }
+}
+
+void Hardware::skip(uint32_t cycles) noexcept {
+    auto const last = mLastOutputs;
+    fastforward(cycles);
+    mLastOutputs = last;
+}
+
 template <class Channel>
-void Hardware::runChannel(size_t index, Channel &ch, Mixer &mixer, uint32_t cycletime, uint32_t cycles) noexcept {
-    auto mix = preRunChannel(index, ch, mixer, cycletime);
-    switch (mix) {
+void Hardware::fastforwardChannel(size_t index, Channel &ch, uint32_t cycles) noexcept {
+    // last outputs must end up the same as they would with run():
+    // silenced channels are zero, muted channels are left as is and mixed
+    // channels have their current output
+    ch.fastforward(cycles);
+    if (ch.isDacOn() && ch.isEnabled()) {
+        if (mMix[index] != MixMode::mute) {
+            mLastOutputs[index] = ch.output();
+        }
+    } else {
+        mLastOutputs[index] = 0;
+    }
+}
+
+template <class Backend, class Channel>
+void Hardware::runChannel(size_t index, Channel &ch, Mixer &mixer, VolumeStep const& volume, Tap *tap, uint32_t cycletime, uint32_t cycles) noexcept {
+    auto mode = mMix[index];
+    if (!ch.isDacOn() || !ch.isEnabled()) {
+        // no mixing required, either the channel's DAC is off or the length
+        // counter disabled the channel
+        silence(index, mixer, volume, tap, cycletime);
+        mode = MixMode::mute;
+    }
+
+    switch (mode) {
         case MixMode::mute:
-            runAndMixChannel<Channel, MixMode::mute>(index, ch, mixer, cycletime, cycles);
+            runAndMixChannel<Backend, Channel, MixMode::mute>(index, ch, mixer, volume, tap, cycletime, cycles);
             break;
         case MixMode::left:
-            runAndMixChannel<Channel, MixMode::left>(index, ch, mixer, cycletime, cycles);
+            runAndMixChannel<Backend, Channel, MixMode::left>(index, ch, mixer, volume, tap, cycletime, cycles);
             break;
         case MixMode::right:
-            runAndMixChannel<Channel, MixMode::right>(index, ch, mixer, cycletime, cycles);
+            runAndMixChannel<Backend, Channel, MixMode::right>(index, ch, mixer, volume, tap, cycletime, cycles);
             break;
         case MixMode::middle:
-            runAndMixChannel<Channel, MixMode::middle>(index, ch, mixer, cycletime, cycles);
+            runAndMixChannel<Backend, Channel, MixMode::middle>(index, ch, mixer, volume, tap, cycletime, cycles);
             break;
         default:
             break;
     }
-
 }
 
-template <class Channel, MixMode mode>
-void Hardware::runAndMixChannel(size_t index, Channel &ch, Mixer &mixer, uint32_t cycletime, uint32_t cycles) noexcept {
+template <class Backend, class Channel, MixMode mode>
+void Hardware::runAndMixChannel(size_t index, Channel &ch, Mixer &mixer, VolumeStep const& volume, Tap *tap, uint32_t cycletime, uint32_t cycles) noexcept {
 
     if constexpr (mode == MixMode::mute) {
 
@@ -764,8 +1191,11 @@ void Hardware::runAndMixChannel(size_t index, Channel &ch, Mixer &mixer, uint32_
         auto mixChanges = [&]() {
             // mix any change in output
             if (auto out = ch.output(); out != last) {
-                mixer.mixfast<mode>(out - last, cycletime);
+                mixer.mixfast<mode, Backend::synthesis>(index, out - last, cycletime, volume);
                 last = out;
+                if (tap) {
+                    tap->record(cycletime, out);
+                }
             }
         };
 
@@ -773,39 +1203,49 @@ void Hardware::runAndMixChannel(size_t index, Channel &ch, Mixer &mixer, uint32_
         auto &timer = ch.timer();
 
         mixChanges();
+
+        ch.prepareEdges();
+        if (ch.isOutputInvariant()) {
+            // the output is constant for this run (ie volume 0, muted wave
+            // or uniform wave RAM), no need to look at any clock
+            ch.fastforward(cycles);
+            return;
+        }
+
         cycletime += timer.counter();
 
         // determine the number of clocks we are stepping
         auto clocks = timer.fastforward(cycles);
         auto const period = timer.period();
 
-        // iterate each clock and mix any change in output
+        // instead of checking every clock, walk from edge to edge using the
+        // channel's edge cache or tables. The volume and waveform cannot
+        // change during a run, any register write or sequencer event starts
+        // a new one.
         while (clocks) {
-            ch.clock();
-            --clocks;
+            auto toChange = ch.clocksToChange();
+            if (toChange == 0 || toChange > clocks) {
+                // no more changes in this run
+                ch.advance(clocks);
+                break;
+            }
+            ch.advance(toChange);
+            clocks -= toChange;
+            cycletime += (toChange - 1) * period;
             mixChanges();
             cycletime += period;
         }
     }
 }
 
-MixMode Hardware::preRunChannel(size_t index, Channel &ch, Mixer &mixer, uint32_t cycletime) noexcept {
-    if (ch.isDacOn() && ch.isEnabled()) {
-        return mMix[index];
-    }
-
-    // no mixing required, either the channel's DAC is off or
-    // the length counter disabled the channel
-    silence(index, mixer, cycletime);
-    return MixMode::mute;
-
-}
-
-void Hardware::silence(size_t channel, Mixer &mixer, uint32_t cycletime) noexcept {
+void Hardware::silence(size_t channel, Mixer &mixer, VolumeStep const& volume, Tap *tap, uint32_t cycletime) noexcept {
     auto &output = mLastOutputs[channel];
     if (output) {
-        mixer.mix(mMix[channel], -output, cycletime);
+        mixer.mix(channel, mMix[channel], -output, cycletime, volume);
         output = 0;
+        if (tap) {
+            tap->record(cycletime, 0);
+        }
     }
 }
 
@@ -818,8 +1258,8 @@ constexpr size_t STEP_WIDTH = 16;   // width, in samples, of a step (MUST BE EVE
 
 // note that the STEP_TABLE has an extra step set for interpolation purposes
 
-// Compressing the STEP_TABLE
-// the STEP_TABLE could be halved in size by taking advantage of symmetry
+// Compressing the STEP_TABLE (KernelFormat::symmetric)
+// the STEP_TABLE can be halved in size by taking advantage of symmetry
 //
 // consider a STEP_TABLE with 4 phases - { A, B, C, D, E} where A,B,C,D,E are step sets
 // split each step in half, the table is now { A1 + A2, B1 + B2, C1 + C2, D1 + D2, E1 + E2 }
@@ -835,12 +1275,13 @@ constexpr size_t STEP_WIDTH = 16;   // width, in samples, of a step (MUST BE EVE
 //
 // Using symmetry reduces the space requirement of the STEP_TABLE by a half
 //  sizeof(STEP_TABLE) = sizeof(float) * (PHASES + 1) * (STEP_WIDTH / 2)
+// this also holds for the generated kernels, their steps are centered the same way
 
 //
 // pre-computed step table for bandlimited-synthesis
 // table is from the blip_buf library, converted to float by multiplying all values by (1/32768.0f)
 // the filter kernel the steps are sampled from appears to be some form of windowed-sinc
-// this table will eventually be replaced with a custom kernel and may even be generated at runtime
+// this is the default kernel, other kernels are generated at runtime (see Mixer::setKernel)
 //
 static float const STEP_TABLE[PHASES + 1][STEP_WIDTH] = {
     { 0.001312256f, -0.003509521f,  0.010681152f, -0.014892578f,  0.034667969f, -0.027893066f,  0.178863525f,  0.641540527f,  0.178863525f, -0.027893066f,  0.034667969f, -0.014892578f,  0.010681152f, -0.003509521f,  0.001312256f,  0.000000000f },
@@ -881,35 +1322,57 @@ static float const STEP_TABLE[PHASES + 1][STEP_WIDTH] = {
 
 }
 
-Mixer::Mixer() :
-    mVolumeStepLeft(0.0f),
-    mVolumeStepRight(0.0f),
+Mixer::Mixer(Allocator &allocator) :
+    mVolume(),
+    mMono(false),
+    mTerminals(2),
     mSamplerate(0),
     mFactor(0.0f),
-    mBuffer(),
+    mRateRatio(1.0),
+    mNextFactor(0.0f),
+    mFrameCycles(0),
+    mFrameSamples(0),
+    mFrameAdvance(0),
+    mFrameOffset(0.0f),
+    mBuffer(allocator),
     mBuffersize(0),
     mAccumulators(),
+    mStems(false),
+    mChannelStride(0),
+    mStemAccumulators(),
     mSampleOffset(0.0f),
+    mCycleBase(0),
     mWriteIndex(0),
-    mHighpassRate(0.0f)
-
+    mMixEnd(0),
+    mHighpassRate(0.0f),
+    mNext(nullptr),
+    mStepTable(&STEP_TABLE[0][0]),
+    mStepWidth(STEP_WIDTH),
+    mPhases(PHASES),
+    mKernel(allocator),
+    mFormat(KernelFormat::full),
+    mFormatTable(allocator),
+    mSynthesis(Synthesis::blep),
+    mBins(allocator),
+    mBinStride(0),
+    mBinOffset(0)
 {
     setSamplerate(44100);
 }
 
 
-void Mixer::mix(MixMode mode, int8_t delta, uint32_t cycletime) {
+void Mixer::mix(size_t channel, MixMode mode, int8_t delta, uint32_t cycletime, VolumeStep const& volume) {
     switch (mode) {
         case MixMode::mute:
             break;
         case MixMode::left:
-            mixfast<MixMode::left>(delta, cycletime);
+            mixfast<MixMode::left>(channel, delta, cycletime, volume);
             break;
         case MixMode::right:
-            mixfast<MixMode::right>(delta, cycletime);
+            mixfast<MixMode::right>(channel, delta, cycletime, volume);
             break;
         case MixMode::middle:
-            mixfast<MixMode::middle>(delta, cycletime);
+            mixfast<MixMode::middle>(channel, delta, cycletime, volume);
             break;
         default:
             break;
@@ -917,27 +1380,48 @@ void Mixer::mix(MixMode mode, int8_t delta, uint32_t cycletime) {
 }
 
 float Mixer::sampletime(uint32_t cycletime) const noexcept {
-    return (cycletime * mFactor) + mSampleOffset;
+    return ((cycletime - mCycleBase) * mFactor) + mSampleOffset;
 }
 
-void Mixer::mixDc(float dcLeft, float dcRight, uint32_t cycletime) {
-    auto buf = mBuffer.get() + (((size_t)sampletime(cycletime) + mWriteIndex) * 2);
-    *buf++ += dcLeft;
-    *buf += dcRight;
+void Mixer::mixDc(size_t channel, float dcLeft, float dcRight, uint32_t cycletime) {
+    if (mSynthesis == Synthesis::oversampled) {
+        // steps are decimated from the bins a bin later, so the offset goes
+        // through the bins too to stay aligned with them
+        if (mMono) {
+            mixBins<MixMode::left, true>(channel, cycletime, (dcLeft + dcRight) * 0.5f, 0.0f);
+        } else {
+            mixBins<MixMode::middle, false>(channel, cycletime, dcLeft, dcRight);
+        }
+    } else {
+        auto const index = (size_t)sampletime(cycletime) + mWriteIndex;
+        mMixEnd = std::max(mMixEnd, index + 1);
+        auto buf = mBuffer.get() + (channel * mChannelStride) + (index * mTerminals);
+        if (mMono) {
+            *buf += (dcLeft + dcRight) * 0.5f;
+        } else {
+            *buf++ += dcLeft;
+            *buf += dcRight;
+        }
+    }
+
+    if (mNext) {
+        mNext->mixDc(channel, dcLeft, dcRight, cycletime);
+    }
 }
 
-Mixer::MixParam Mixer::getMixParameters(uint32_t cycletime) {
+Mixer::MixParam Mixer::getMixParameters(size_t channel, uint32_t cycletime) {
     // convert cycle time to sample time, separating the
     // integral and fraction components
 
     // modff was too slow
     float time = sampletime(cycletime);
-    float phase = (time - (int)time) * PHASES;
+
+    auto const index = (size_t)time + mWriteIndex;
+    mMixEnd = std::max(mMixEnd, index + mStepWidth);
 
     return {
-        STEP_TABLE[(int)(phase)],
-        mBuffer.get() + (((size_t)time + mWriteIndex) * 2),
-        phase - (int)phase
+        mBuffer.get() + (channel * mChannelStride) + (index * mTerminals),
+        time - (int)time
     };
 }
 
@@ -951,101 +1435,716 @@ static inline std::pair<float, float> deltaScale(float delta, float scale, float
     return std::make_pair(delta - deltaInterp, deltaInterp);
 }
 
+//
+// Adds one sample of a step to the buffer, interpolating the stepset with the
+// next one. In mono, the buffer has one terminal and the mode is
+// MixMode::left.
+//
+template <MixMode mode, bool mono>
+static inline void mixSample(
+    float *&dest,
+    float s0,
+    float s1,
+    std::pair<float, float> deltaLeft,
+    std::pair<float, float> deltaRight
+) {
+    if constexpr (modePansLeft(mode)) {
+        *dest++ += deltaLeft.first * s0 + deltaLeft.second * s1;
+    }
+
+    if constexpr (modePansRight(mode)) {
+        *dest++ += deltaRight.first * s0 + deltaRight.second * s1;
+    }
+
+    if constexpr (mode != MixMode::middle && !mono) {
+        ++dest;
+    }
+}
+
+//
+// Adds a step of the given width to the buffer
+//
+template <MixMode mode, size_t width, bool mono>
+static inline void mixStep(
+    float *dest,
+    float const* stepset,
+    std::pair<float, float> deltaLeft,
+    std::pair<float, float> deltaRight
+) {
+    auto nextset = stepset + width;
+    for (auto i = width; i--; ) {
+        mixSample<mode, mono>(dest, *stepset++, *nextset++, deltaLeft, deltaRight);
+    }
+}
+
+//
+// Same as mixStep, but for a symmetric table of half sets. The first half of
+// the step is read forwards from the given phase and the next, the second
+// half is read backwards from the mirrored phases.
+//
+template <MixMode mode, size_t width, bool mono>
+static inline void mixStepSymmetric(
+    float *dest,
+    float const* table,
+    size_t phases,
+    size_t phase,
+    std::pair<float, float> deltaLeft,
+    std::pair<float, float> deltaRight
+) {
+    constexpr auto half = width / 2;
+
+    auto stepset = table + (phase * half);
+    auto nextset = stepset + half;
+    for (auto i = half; i--; ) {
+        mixSample<mode, mono>(dest, *stepset++, *nextset++, deltaLeft, deltaRight);
+    }
+
+    // start from the end of the mirrored sets, phases - phase and
+    // phases - phase - 1
+    auto mirrorset = table + ((phases - phase + 1) * half);
+    auto mirrornext = mirrorset - half;
+    for (auto i = half; i--; ) {
+        mixSample<mode, mono>(dest, *--mirrorset, *--mirrornext, deltaLeft, deltaRight);
+    }
+}
+
+//
+// Same as mixStep, but the stepset is already interpolated
+//
+template <MixMode mode, size_t width, bool mono>
+static inline void mixStepFine(
+    float *dest,
+    float const* stepset,
+    float deltaLeft,
+    float deltaRight
+) {
+    for (auto i = width; i--; ) {
+        auto const s = *stepset++;
+
+        if constexpr (modePansLeft(mode)) {
+            *dest++ += deltaLeft * s;
+        }
+
+        if constexpr (modePansRight(mode)) {
+            *dest++ += deltaRight * s;
+        }
+
+        if constexpr (mode != MixMode::middle && !mono) {
+            ++dest;
+        }
+    }
+}
+
 
 template <MixMode mode>
-void Mixer::mixfast(int8_t delta, uint32_t cycletime) {
+void Mixer::mixfast(size_t channel, int8_t delta, uint32_t cycletime, VolumeStep const& volume) {
     // muted mixing is a no-op, so don't bother instantiating a template
     // for this mode.
     static_assert(mode != MixMode::mute, "cannot mix a muted mode!");
 
-    auto param = getMixParameters(cycletime);
+    switch (mSynthesis) {
+        case Synthesis::linear:
+            mixfast<mode, Synthesis::linear>(channel, delta, cycletime, volume);
+            break;
+        case Synthesis::nearest:
+            mixfast<mode, Synthesis::nearest>(channel, delta, cycletime, volume);
+            break;
+        case Synthesis::oversampled:
+            mixfast<mode, Synthesis::oversampled>(channel, delta, cycletime, volume);
+            break;
+        default:
+            mixfast<mode, Synthesis::blep>(channel, delta, cycletime, volume);
+            break;
+    }
+}
 
-    if constexpr (mode == MixMode::right) {
-        ++param.dest;
+template <MixMode mode, Synthesis synthesis>
+void Mixer::mixfast(size_t channel, int8_t delta, uint32_t cycletime, VolumeStep const& volume) {
+    static_assert(mode != MixMode::mute, "cannot mix a muted mode!");
+
+    if (mMono) {
+        // both terminals are folded into a single stream
+        auto const deltaMono = delta * volume.mono[(size_t)mode];
+        mixSynthesized<MixMode::left, synthesis, true>(channel, cycletime, deltaMono, 0.0f);
+    } else {
+        auto const deltaLeft = delta * volume.left;
+        auto const deltaRight = delta * volume.right;
+        mixSynthesized<mode, synthesis, false>(channel, cycletime, deltaLeft, deltaRight);
+    }
+
+    // the next mixer can have a different synthesis
+    if (mNext) {
+        mNext->mixfast<mode>(channel, delta, cycletime, volume);
+    }
+}
+
+template <MixMode mode, Synthesis synthesis, bool mono>
+void Mixer::mixSynthesized(size_t channel, uint32_t cycletime, float deltaLeft, float deltaRight) {
+    if constexpr (synthesis == Synthesis::oversampled) {
+        mixBins<mode, mono>(channel, cycletime, deltaLeft, deltaRight);
+    } else {
+        auto const param = getMixParameters(channel, cycletime);
+        if constexpr (synthesis == Synthesis::linear) {
+            mixLinear<mode, mono>(param, deltaLeft, deltaRight);
+        } else if constexpr (synthesis == Synthesis::nearest) {
+            mixNearest<mode, mono>(param, deltaLeft, deltaRight);
+        } else {
+            mixScaled<mode, mono>(param, deltaLeft, deltaRight);
+        }
     }
+}
 
-    std::pair<float, float> deltaLeft, deltaRight;
+template <MixMode mode, bool mono>
+void Mixer::mixLinear(MixParam param, float deltaLeft, float deltaRight) {
+    // same delay as the kernel's center, the next sample is one sample of
+    // terminals away
+    constexpr size_t terminals = mono ? 1 : 2;
+    auto dest = param.dest + ((mStepWidth / 2 - 1) * terminals);
 
     if constexpr (modePansLeft(mode)) {
-        deltaLeft = deltaScale(delta, mVolumeStepLeft, param.timeFract);
+        auto const deltaNext = deltaLeft * param.fract;
+        dest[0] += deltaLeft - deltaNext;
+        dest[terminals] += deltaNext;
     }
 
     if constexpr (modePansRight(mode)) {
-        deltaRight = deltaScale(delta, mVolumeStepRight, param.timeFract);
+        auto const deltaNext = deltaRight * param.fract;
+        dest[1] += deltaRight - deltaNext;
+        dest[3] += deltaNext;
+    }
+}
+
+template <MixMode mode, bool mono>
+void Mixer::mixNearest(MixParam param, float deltaLeft, float deltaRight) {
+    constexpr size_t terminals = mono ? 1 : 2;
+    auto dest = param.dest + ((mStepWidth / 2 - 1) * terminals);
+    if (param.fract >= 0.5f) {
+        dest += terminals;
+    }
+
+    if constexpr (modePansLeft(mode)) {
+        dest[0] += deltaLeft;
+    }
+
+    if constexpr (modePansRight(mode)) {
+        dest[1] += deltaRight;
+    }
+}
+
+template <MixMode mode, bool mono>
+void Mixer::mixBins(size_t channel, uint32_t cycletime, float deltaLeft, float deltaRight) {
+    // box filter the step, the bin's average level changes by the part of
+    // the bin after the step, the rest of the change is in the next bin
+    constexpr size_t terminals = mono ? 1 : 2;
+    auto const time = (cycletime - mCycleBase) + mBinOffset;
+    auto const fract = (time % BIN_CYCLES) * (1.0f / BIN_CYCLES);
+    auto const region = mStems ? channel : 0;
+    auto bin = mBins.get() + (region * mBinStride) + ((time / BIN_CYCLES) * terminals);
+
+    if constexpr (modePansLeft(mode)) {
+        auto const deltaNext = deltaLeft * fract;
+        bin[0] += deltaLeft - deltaNext;
+        bin[terminals] += deltaNext;
+    }
+
+    if constexpr (modePansRight(mode)) {
+        auto const deltaNext = deltaRight * fract;
+        bin[1] += deltaRight - deltaNext;
+        bin[3] += deltaNext;
+    }
+}
+
+template <MixMode mode, bool mono>
+void Mixer::mixScaled(MixParam param, float deltaLeft, float deltaRight) {
+    if constexpr (mode == MixMode::right) {
+        ++param.dest;
     }
 
-    // interpolate with the next step set
-    auto nextset = param.stepset + STEP_WIDTH;
-    for (auto i = STEP_WIDTH; i--; ) {
-        auto const s0 = *param.stepset++;
-        auto const s1 = *nextset++;
+    // width is a template parameter so each loop can be unrolled
+    if (mFormat == KernelFormat::fine) {
+        // nearest set, the table has an extra set for rounding up
+        auto const stepset = mFormatTable.get() + ((size_t)(param.fract * FINE_PHASES + 0.5f) * mStepWidth);
+        switch (mStepWidth) {
+            case 8:
+                mixStepFine<mode, 8, mono>(param.dest, stepset, deltaLeft, deltaRight);
+                break;
+            case 32:
+                mixStepFine<mode, 32, mono>(param.dest, stepset, deltaLeft, deltaRight);
+                break;
+            default:
+                mixStepFine<mode, 16, mono>(param.dest, stepset, deltaLeft, deltaRight);
+                break;
+        }
+    } else {
+        float const phase = param.fract * mPhases;
+        float const timeFract = phase - (int)phase;
 
+        std::pair<float, float> interpLeft, interpRight;
 
         if constexpr (modePansLeft(mode)) {
-            *param.dest++ += deltaLeft.first * s0 + deltaLeft.second * s1;
+            interpLeft = deltaScale(deltaLeft, 1.0f, timeFract);
         }
 
         if constexpr (modePansRight(mode)) {
-            *param.dest++ += deltaRight.first * s0 + deltaRight.second * s1;
+            interpRight = deltaScale(deltaRight, 1.0f, timeFract);
         }
 
-        if constexpr (mode != MixMode::middle) {
-            ++param.dest;
+        if (mFormat == KernelFormat::symmetric) {
+            auto const table = mFormatTable.get();
+            switch (mStepWidth) {
+                case 8:
+                    mixStepSymmetric<mode, 8, mono>(param.dest, table, mPhases, (int)phase, interpLeft, interpRight);
+                    break;
+                case 32:
+                    mixStepSymmetric<mode, 32, mono>(param.dest, table, mPhases, (int)phase, interpLeft, interpRight);
+                    break;
+                default:
+                    mixStepSymmetric<mode, 16, mono>(param.dest, table, mPhases, (int)phase, interpLeft, interpRight);
+                    break;
+            }
+        } else {
+            auto const stepset = mStepTable + ((int)phase * mStepWidth);
+            switch (mStepWidth) {
+                case 8:
+                    mixStep<mode, 8, mono>(param.dest, stepset, interpLeft, interpRight);
+                    break;
+                case 32:
+                    mixStep<mode, 32, mono>(param.dest, stepset, interpLeft, interpRight);
+                    break;
+                default:
+                    mixStep<mode, 16, mono>(param.dest, stepset, interpLeft, interpRight);
+                    break;
+            }
+        }
+    }
+}
+
+void Mixer::setSynthesis(Synthesis synthesis) {
+    if (mSynthesis != synthesis) {
+        mSynthesis = synthesis;
+        if (synthesis == Synthesis::oversampled) {
+            allocateBins();
+        } else {
+            mBins.reset();
+            mBinStride = 0;
+        }
+        clear();
+    }
+}
+
+Synthesis Mixer::synthesis() const noexcept {
+    return mSynthesis;
+}
+
+void Mixer::allocateBins() {
+    if (mBuffersize == 0) {
+        // released, allocated again with the buffer
+        mBins.reset();
+        mBinStride = 0;
+        return;
+    }
+    mBinStride = binStride();
+    mBins.allocate(mBinStride * regions());
+    mBinOffset = 0;
+}
+
+size_t Mixer::binStride() const noexcept {
+    // enough bins to fill the buffer, plus the two carried over from the
+    // previous frame and one for the last bin's spill
+    auto const cycles = (size_t)((mBuffersize / mTerminals) / std::min(mFactor, mNextFactor));
+    return ((cycles / BIN_CYCLES) + 3) * mTerminals;
+}
+
+void Mixer::growBins() {
+    auto bins = std::move(mBins);
+    auto const stride = mBinStride;
+    auto const offset = mBinOffset;
+    allocateBins();
+    for (size_t region = 0; region != regions(); ++region) {
+        std::copy_n(bins.get() + (region * stride), std::min(stride, mBinStride), mBins.get() + (region * mBinStride));
+    }
+    mBinOffset = offset;
+}
+
+void Mixer::decimate(uint32_t cycletime) {
+    auto const total = (cycletime - mCycleBase) + mBinOffset;
+    auto const bins = total / BIN_CYCLES;
+    for (size_t region = 0; region != regions(); ++region) {
+        auto const src = mBins.get() + (region * mBinStride);
+        for (uint32_t bin = 0; bin != bins; ++bin) {
+            // each bin is mixed at the time it ends
+            auto const time = mCycleBase + ((bin + 1) * BIN_CYCLES) - mBinOffset;
+            if (mMono) {
+                auto const delta = src[bin];
+                if (delta != 0.0f) {
+                    mixScaled<MixMode::left, true>(getMixParameters(region, time), delta, 0.0f);
+                }
+            } else {
+                auto const left = src[bin * 2];
+                auto const right = src[bin * 2 + 1];
+                if (left != 0.0f || right != 0.0f) {
+                    mixScaled<MixMode::middle>(getMixParameters(region, time), left, right);
+                }
+            }
         }
+
+        // the partial bin at the end of the frame, and the spill from it
+        std::copy_n(src + (bins * mTerminals), mTerminals * 2, src);
+        std::fill(src + (mTerminals * 2), src + ((bins + 2) * mTerminals), 0.0f);
     }
+    mBinOffset = total % BIN_CYCLES;
+}
 
+void Mixer::setNext(Mixer *next) noexcept {
+    mNext = next;
 }
 
 void Mixer::setVolume(float leftVolume, float rightVolume) {
-    mVolumeStepLeft = leftVolume;
-    mVolumeStepRight = rightVolume;
+    mVolume = VolumeStep(leftVolume, rightVolume);
+}
+
+VolumeStep const& Mixer::volume() const noexcept {
+    return mVolume;
 }
 
 float Mixer::leftVolume() const noexcept {
-    return mVolumeStepLeft;
+    return mVolume.left;
 }
 
 float Mixer::rightVolume() const noexcept {
-    return mVolumeStepRight;
+    return mVolume.right;
+}
+
+void Mixer::setMono(bool enabled) {
+    if (mMono != enabled) {
+        auto const samples = mBuffersize / mTerminals;
+        mMono = enabled;
+        mTerminals = enabled ? 1 : 2;
+        mBuffersize = samples * mTerminals;
+        mBuffer.allocate(mBuffersize * regions());
+        mChannelStride = mStems ? mBuffersize : 0;
+        if (mSynthesis == Synthesis::oversampled) {
+            allocateBins();
+        }
+        clear();
+    }
+}
+
+bool Mixer::monoEnabled() const noexcept {
+    return mMono;
 }
 
 void Mixer::setBuffer(size_t samples) {
-    auto size = (samples + STEP_WIDTH) * 2;
+    // room for the widest kernel, so that the kernel can be changed anytime
+    auto size = (samples + MAX_KERNEL_WIDTH) * mTerminals;
     if (size != mBuffersize) {
-        mBuffer = std::make_unique<float[]>(size);
+        mBuffer.allocate(size * regions());
         mBuffersize = size;
+        mChannelStride = mStems ? size : 0;
+        if (mSynthesis == Synthesis::oversampled) {
+            allocateBins();
+        }
     }
     clear();
 }
 
+void Mixer::growBuffer(size_t samples) {
+    auto const size = (samples + MAX_KERNEL_WIDTH) * mTerminals;
+    if (size <= mBuffersize) {
+        return;
+    }
+
+    Buffer<float> buffer(mBuffer.allocator());
+    buffer.allocate(size * regions());
+    for (size_t region = 0; region != regions(); ++region) {
+        std::copy_n(mBuffer.get() + (region * mBuffersize), mBuffersize, buffer.get() + (region * size));
+    }
+    mBuffer = std::move(buffer);
+    mBuffersize = size;
+    mChannelStride = mStems ? size : 0;
+
+    if (mSynthesis == Synthesis::oversampled) {
+        growBins();
+    }
+}
+
+void Mixer::releaseBuffer() {
+    mBuffer.reset();
+    mBins.reset();
+    mBuffersize = 0;
+    mBinStride = 0;
+    mChannelStride = 0;
+    clear();
+}
+
+uint32_t Mixer::cyclesAvailable(uint32_t cycletime) const noexcept {
+    // a step mixed at sample index i writes up to i + MAX_KERNEL_WIDTH, and
+    // the buffer has MAX_KERNEL_WIDTH samples past its size for this. One
+    // sample is left as a margin for rounding.
+    auto const capacity = (float)bufferSize();
+    auto const used = mWriteIndex + sampletime(cycletime) + 1.0f;
+    if (used >= capacity) {
+        return 0;
+    }
+    return (uint32_t)std::min((double)((capacity - used) / mFactor), (double)UINT32_MAX);
+}
+
+size_t Mixer::bufferSize() const noexcept {
+    return mBuffersize / mTerminals - MAX_KERNEL_WIDTH;
+}
+
+size_t Mixer::samplesNeeded(uint32_t cycletime) const noexcept {
+    return mWriteIndex + (size_t)sampletime(cycletime) + 2;
+}
+
+void Mixer::setStems(bool enabled) {
+    if (mStems != enabled) {
+        mStems = enabled;
+        mBuffer.allocate(mBuffersize * regions());
+        mChannelStride = mStems ? mBuffersize : 0;
+        if (mSynthesis == Synthesis::oversampled) {
+            allocateBins();
+        }
+        clear();
+    }
+}
+
+bool Mixer::stemsEnabled() const noexcept {
+    return mStems;
+}
+
+size_t Mixer::regions() const noexcept {
+    return mStems ? 4 : 1;
+}
+
 void Mixer::setSamplerate(unsigned rate) {
     if (mSamplerate != rate) {
         mSamplerate = rate;
-        mFactor = mSamplerate / constants::CLOCK_SPEED<float>;
+        auto const factor = mSamplerate / constants::CLOCK_SPEED<float>;
+        updateNextFactor();
+        mFactor = mNextFactor;
         // using SameBoy's HPF (GB_HIGHPASS_ACCURATE)
-        mHighpassRate = powf(0.999958f, 1.0f / mFactor);
+        mHighpassRate = powf(0.999958f, 1.0f / factor);
+        if (mKernel) {
+            generateKernel();
+        }
+        if (mSynthesis == Synthesis::oversampled) {
+            allocateBins();
+        }
+    }
+}
+
+unsigned Mixer::samplerate() const noexcept {
+    return mSamplerate;
+}
+
+void Mixer::setRateRatio(double ratio) {
+    // written this way so that NaN is rejected too
+    if (!(ratio > 0.0) || !std::isfinite(ratio)) {
+        return;
+    }
+    mRateRatio = ratio;
+    updateNextFactor();
+}
+
+double Mixer::rateRatio() const noexcept {
+    return mRateRatio;
+}
+
+void Mixer::setFramePeriod(uint32_t cycles, size_t samples) {
+    mFrameCycles = cycles;
+    mFrameSamples = samples;
+    updateNextFactor();
+}
+
+size_t Mixer::samplesPerFrame() const noexcept {
+    if (mFrameCycles == 0) {
+        return 0;
+    }
+    if (mFrameSamples) {
+        return mFrameSamples;
+    }
+    return (size_t)std::max(1.0, std::round(mFrameCycles * (double)mSamplerate / constants::CLOCK_SPEED<double>));
+}
+
+void Mixer::updateNextFactor() {
+    if (mFrameCycles) {
+        mNextFactor = (float)((double)samplesPerFrame() / mFrameCycles);
+    } else {
+        mNextFactor = (mSamplerate / constants::CLOCK_SPEED<float>) * (float)mRateRatio;
+    }
+    // a lower rate needs more bins to fill the buffer
+    if (mSynthesis == Synthesis::oversampled && binStride() > mBinStride) {
+        growBins();
+    }
+}
+
+void Mixer::setKernel(size_t width, size_t phases) {
+    if (width == 0) {
+        mKernel.reset();
+        mStepTable = &STEP_TABLE[0][0];
+        mStepWidth = STEP_WIDTH;
+        mPhases = PHASES;
+        buildFormatTable();
+        return;
+    }
+
+    // round up to a supported width, mixScaled only has cases for these
+    mStepWidth = width <= 8 ? 8 : width <= 16 ? 16 : MAX_KERNEL_WIDTH;
+    mPhases = phases ? phases : PHASES;
+    mKernel.allocate((mPhases + 1) * mStepWidth);
+    mStepTable = mKernel.get();
+    generateKernel();
+}
+
+void Mixer::setKernelFormat(KernelFormat format) {
+    if (mFormat != format) {
+        mFormat = format;
+        buildFormatTable();
     }
 }
 
+KernelFormat Mixer::kernelFormat() const noexcept {
+    return mFormat;
+}
+
+void Mixer::buildFormatTable() {
+    switch (mFormat) {
+        case KernelFormat::symmetric: {
+            // keep the first half of every set
+            auto const half = mStepWidth / 2;
+            mFormatTable.allocate((mPhases + 1) * half);
+            for (size_t phase = 0; phase <= mPhases; ++phase) {
+                std::copy_n(mStepTable + (phase * mStepWidth), half, mFormatTable.get() + (phase * half));
+            }
+            break;
+        }
+        case KernelFormat::fine: {
+            // interpolate each fine phase from the two nearest sets
+            mFormatTable.allocate((FINE_PHASES + 1) * mStepWidth);
+            auto dest = mFormatTable.get();
+            for (size_t fine = 0; fine <= FINE_PHASES; ++fine) {
+                auto const phase = (float)fine / FINE_PHASES * mPhases;
+                // the last fine set is the extra set, interpolated fully
+                auto const set = std::min((size_t)phase, mPhases - 1);
+                auto const interp = phase - set;
+                auto const stepset = mStepTable + (set * mStepWidth);
+                auto const nextset = stepset + mStepWidth;
+                for (size_t i = 0; i != mStepWidth; ++i) {
+                    *dest++ = stepset[i] + (nextset[i] - stepset[i]) * interp;
+                }
+            }
+            break;
+        }
+        default:
+            mFormatTable.reset();
+            break;
+    }
+}
+
+void Mixer::generateKernel() {
+    constexpr double PI = 3.14159265358979323846;
+
+    // cutoff as a fraction of the samplerate, leaving some room for the
+    // transition band at lower samplerates
+    auto const cutoff = std::min(20000.0, mSamplerate * 0.45) / mSamplerate;
+
+    auto const width = (double)mStepWidth;
+    auto set = mKernel.get();
+    for (size_t phase = 0; phase <= mPhases; ++phase) {
+        // the center is in the same place as the default kernel's, between
+        // samples width/2 - 1 and width/2 for phase 0.5
+        auto const center = (width / 2) - 1 + ((double)phase / mPhases);
+
+        std::array<double, MAX_KERNEL_WIDTH> taps;
+        double sum = 0.0;
+        for (size_t i = 0; i != mStepWidth; ++i) {
+            auto const x = i - center;
+            // sinc, lowpassed to the cutoff
+            auto const sinc = x == 0.0 ? 2 * cutoff : sin(2 * PI * cutoff * x) / (PI * x);
+            // blackman window, spanning the width of the kernel
+            auto const w = 0.42 + (0.5 * cos(2 * PI * x / width)) + (0.08 * cos(4 * PI * x / width));
+            taps[i] = std::fabs(x) < width / 2 ? sinc * w : 0.0;
+            sum += taps[i];
+        }
+
+        // normalize so that each step has a gain of 1
+        for (size_t i = 0; i != mStepWidth; ++i) {
+            set[i] = (float)(taps[i] / sum);
+        }
+        set += mStepWidth;
+    }
+
+    buildFormatTable();
+}
+
 void Mixer::clear() {
+    mCycleBase = 0;
+    mFrameAdvance = 0;
+    mFrameOffset = 0.0f;
+    // nothing is mixed, so a pending rate can start now
+    mFactor = mNextFactor;
+    if (mBins) {
+        std::fill_n(mBins.get(), mBinStride * regions(), 0.0f);
+        mBinOffset = 0;
+    }
     mSampleOffset = 0.0f;
     mWriteIndex = 0;
+    mMixEnd = 0;
     for (auto &accum : mAccumulators) {
         accum.reset();
     }
-    std::fill_n(mBuffer.get(), mBuffersize, 0.0f);
+    for (auto &stem : mStemAccumulators) {
+        for (auto &accum : stem) {
+            accum.reset();
+        }
+    }
+    std::fill_n(mBuffer.get(), mBuffersize * regions(), 0.0f);
 }
 
 void Mixer::endFrame(uint32_t cycletime) {
+    // a frame of the frame period, mixed entirely with its factor
+    auto const exact = mFrameCycles && cycletime == mFrameCycles && mFactor == mNextFactor;
+
+    flush(cycletime);
+    if (exact) {
+        // the count and offset come from the rational model, the float
+        // sample time is only off by rounding
+        mWriteIndex = mWriteIndex - mFrameAdvance + samplesPerFrame();
+        mSampleOffset = mFrameOffset;
+    }
+    mFrameAdvance = 0;
+    mFrameOffset = mSampleOffset;
+    mCycleBase = 0;
+}
+
+void Mixer::flush(uint32_t cycletime) {
+    if (mSynthesis == Synthesis::oversampled) {
+        decimate(cycletime);
+    }
     float index;
     mSampleOffset = modff(sampletime(cycletime), &index);
     mWriteIndex += (size_t)index;
+    mFrameAdvance += (size_t)index;
+    mCycleBase = cycletime;
+    // sample time restarts here, so the rate can change without moving
+    // anything already mixed
+    mFactor = mNextFactor;
 }
 
 size_t Mixer::availableSamples() const noexcept {
     return mWriteIndex;
 }
 
+float Mixer::sampleOffset() const noexcept {
+    return mSampleOffset;
+}
+
+void Mixer::setSampleOffset(float offset) noexcept {
+    mSampleOffset = offset;
+    mFrameOffset = offset;
+}
+
 void Mixer::Accum::reset() {
     sum = highpass = 0.0f;
 }
@@ -1057,15 +2156,182 @@ void Mixer::Accum::process(float *dest, float in, float highPassRate) {
     *dest = in;
 }
 
+namespace {
+
+// outputs below this are silent, one LSB of 16-bit PCM. Due to float
+// precision, the filter's output can stall a little above zero when the sum
+// is large, so this can't be much smaller.
+constexpr float SETTLE_THRESHOLD = 1.0f / 32768;
+
+}
+
+float Mixer::Accum::output() const noexcept {
+    return sum - highpass;
+}
+
+bool Mixer::Accum::isSettled() const noexcept {
+    return std::fabs(sum - highpass) < SETTLE_THRESHOLD;
+}
+
+bool Mixer::Accum::isSteady(float highPassRate) const noexcept {
+    // process the same way as reading would, so that this is exact
+    auto next = *this;
+    float out;
+    next.process(&out, 0.0f, highPassRate);
+    return next.sum == sum && next.highpass == highpass;
+}
+
+bool Mixer::isBufferEmpty() const noexcept {
+    if (mMixEnd) {
+        return false;
+    }
+    if (mSynthesis == Synthesis::oversampled) {
+        // only the bins carried over from the last frame can be non-zero
+        for (size_t region = 0; region != regions(); ++region) {
+            auto const bins = mBins.get() + (region * mBinStride);
+            if (std::any_of(bins, bins + (mTerminals * 2), [](float bin) { return bin != 0.0f; })) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool Mixer::isIdle() const noexcept {
+    if (!isBufferEmpty()) {
+        return false;
+    }
+    if (mStems) {
+        for (auto const& stem : mStemAccumulators) {
+            if (!stem[0].isSettled() || !stem[1].isSettled()) {
+                return false;
+            }
+        }
+        return true;
+    } else {
+        return mAccumulators[0].isSettled() && mAccumulators[1].isSettled();
+    }
+}
+
+bool Mixer::isSteady() const noexcept {
+    if (!isBufferEmpty()) {
+        return false;
+    }
+    auto steady = [this](std::array<Accum, 2> const& accums) {
+        return accums[0].isSteady(mHighpassRate) && accums[1].isSteady(mHighpassRate);
+    };
+    if (mStems) {
+        return std::all_of(mStemAccumulators.begin(), mStemAccumulators.end(), steady);
+    } else {
+        return steady(mAccumulators);
+    }
+}
+
 
 size_t Mixer::readSamples(float *buf, size_t samples) {
+    if (mStems) {
+        // the output is the sum of the stem outputs
+        return readStems(buf, {}, samples);
+    }
+
     samples = std::min(samples, mWriteIndex);
     if (samples) {
 
+        if (isSteady()) {
+            // nothing to integrate and the filter is steady, the output is
+            // constant (usually silence)
+            if (mMono) {
+                std::fill_n(buf, samples, mAccumulators[0].output());
+            } else {
+                auto const left = mAccumulators[0].output();
+                auto const right = mAccumulators[1].output();
+                for (size_t i = samples; i--; ) {
+                    *buf++ = left;
+                    *buf++ = right;
+                }
+            }
+            mWriteIndex -= samples;
+            return samples;
+        }
+
         float const* in = mBuffer.get();
-        for (size_t i = samples; i--; ) {
-            mAccumulators[0].process(buf++, *in++, mHighpassRate);
-            mAccumulators[1].process(buf++, *in++, mHighpassRate);
+        if (mMono) {
+            for (size_t i = samples; i--; ) {
+                mAccumulators[0].process(buf++, *in++, mHighpassRate);
+            }
+        } else {
+            for (size_t i = samples; i--; ) {
+                mAccumulators[0].process(buf++, *in++, mHighpassRate);
+                mAccumulators[1].process(buf++, *in++, mHighpassRate);
+            }
+        }
+        removeSamples(samples);
+    }
+
+    return samples;
+}
+
+size_t Mixer::readStems(float *buf, std::array<float*, 4> const& stems, size_t samples) {
+    if (!mStems) {
+        if (buf) {
+            return readSamples(buf, samples);
+        }
+        samples = std::min(samples, mWriteIndex);
+        removeSamples(samples);
+        return samples;
+    }
+
+    samples = std::min(samples, mWriteIndex);
+    if (samples) {
+        if (isSteady()) {
+            // same as below with constant stem outputs, summed in the same
+            // order
+            std::array<float, 2> sum = { 0.0f, 0.0f };
+            for (size_t ch = 0; ch != stems.size(); ++ch) {
+                auto const& accums = mStemAccumulators[ch];
+                std::array<float, 2> const out = { accums[0].output(), accums[1].output() };
+                if (stems[ch]) {
+                    auto stem = stems[ch];
+                    for (size_t i = 0; i != samples * mTerminals; ++i) {
+                        *stem++ = out[i & (mTerminals - 1)];
+                    }
+                }
+                sum[0] += out[0];
+                sum[1] += out[1];
+            }
+            if (buf) {
+                for (size_t i = 0; i != samples * mTerminals; ++i) {
+                    *buf++ = sum[i & (mTerminals - 1)];
+                }
+            }
+            mWriteIndex -= samples;
+            return samples;
+        }
+
+        if (buf) {
+            std::fill_n(buf, samples * mTerminals, 0.0f);
+        }
+
+        // each stem is integrated and filtered separately. Both are linear,
+        // so the sum of the stem outputs is the same as the output of the
+        // sum of the stems.
+        for (size_t ch = 0; ch != stems.size(); ++ch) {
+            float const* in = mBuffer.get() + (ch * mChannelStride);
+            auto &accums = mStemAccumulators[ch];
+            auto stem = stems[ch];
+            auto out = buf;
+            for (size_t i = 0; i != samples * mTerminals; ++i) {
+                // the terminals are interleaved, in mono only the first
+                // accumulator is used
+                float sample;
+                accums[i & (mTerminals - 1)].process(&sample, *in++, mHighpassRate);
+                if (stem) {
+                    *stem++ = sample;
+                }
+                if (out) {
+                    *out++ += sample;
+                }
+            }
         }
         removeSamples(samples);
     }
@@ -1073,17 +2339,62 @@ size_t Mixer::readSamples(float *buf, size_t samples) {
     return samples;
 }
 
+size_t Mixer::readDeltas(float *buf, size_t samples) {
+    samples = std::min(samples, mWriteIndex);
+    if (samples) {
+        std::copy_n(mBuffer.get(), samples * mTerminals, buf);
+        for (size_t ch = 1; ch < regions(); ++ch) {
+            auto in = mBuffer.get() + (ch * mChannelStride);
+            std::transform(buf, buf + (samples * mTerminals), in, buf, std::plus<float>());
+        }
+        removeSamples(samples);
+    }
+
+    return samples;
+}
+
+void Mixer::integrate(float *buf, size_t samples) {
+    if (mMono) {
+        for (size_t i = samples; i--; ) {
+            mAccumulators[0].process(buf, *buf, mHighpassRate);
+            ++buf;
+        }
+        return;
+    }
+
+    for (size_t i = samples; i--; ) {
+        mAccumulators[0].process(buf, *buf, mHighpassRate);
+        ++buf;
+        mAccumulators[1].process(buf, *buf, mHighpassRate);
+        ++buf;
+    }
+}
+
 void Mixer::removeSamples(size_t samples) {
-    auto amountInFrames = samples * 2;
-    std::copy(mBuffer.get() + amountInFrames, mBuffer.get() + mBuffersize, mBuffer.get());
-    std::fill_n(mBuffer.get() + (mBuffersize - amountInFrames), amountInFrames, 0.0f);
+    // everything past mMixEnd is already zero, so only the mixed part of the
+    // buffer needs to be moved
+    if (mMixEnd > samples) {
+        auto const amountInFrames = samples * mTerminals;
+        auto const mixedInFrames = mMixEnd * mTerminals;
+        for (size_t ch = 0; ch != regions(); ++ch) {
+            auto region = mBuffer.get() + (ch * mBuffersize);
+            std::copy(region + amountInFrames, region + mixedInFrames, region);
+            std::fill_n(region + (mixedInFrames - amountInFrames), amountInFrames, 0.0f);
+        }
+        mMixEnd -= samples;
+    } else if (mMixEnd) {
+        for (size_t ch = 0; ch != regions(); ++ch) {
+            std::fill_n(mBuffer.get() + (ch * mBuffersize), mMixEnd * mTerminals, 0.0f);
+        }
+        mMixEnd = 0;
+    }
     mWriteIndex -= samples;
 }
 
 
-template void Mixer::mixfast<MixMode::left>(int8_t delta, uint32_t cycletime);
-template void Mixer::mixfast<MixMode::right>(int8_t delta, uint32_t cycletime);
-template void Mixer::mixfast<MixMode::middle>(int8_t delta, uint32_t cycletime);
+template void Mixer::mixfast<MixMode::left>(size_t channel, int8_t delta, uint32_t cycletime, VolumeStep const& volume);
+template void Mixer::mixfast<MixMode::right>(size_t channel, int8_t delta, uint32_t cycletime, VolumeStep const& volume);
+template void Mixer::mixfast<MixMode::middle>(size_t channel, int8_t delta, uint32_t cycletime, VolumeStep const& volume);
 
 
 }
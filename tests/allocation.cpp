@@ -0,0 +1,208 @@
+//
+// Checks that an Apu constructed with an allocator only allocates through
+// it, from construction and configuration on. Also checks that its buffers
+// are aligned, and that nothing allocates while writing registers,
+// stepping, reading samples or flushing to a sink, and that an Apu mixing
+// into a host frees its buffer.
+//
+
+#include "gbapu.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <vector>
+
+namespace {
+
+// allocations made with the global operator new while counting
+bool counting = false;
+size_t globalAllocations = 0;
+
+void* countedAlloc(size_t bytes, size_t alignment) {
+    if (counting) {
+        ++globalAllocations;
+    }
+    bytes = bytes ? bytes : 1;
+    void *ptr = alignment > alignof(std::max_align_t)
+        ? std::aligned_alloc(alignment, (bytes + alignment - 1) & ~(alignment - 1))
+        : std::malloc(bytes);
+    if (ptr == nullptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+//
+// Forwards to the default allocator, recording every allocation
+//
+class TrackingAllocator : public gbapu::Allocator {
+
+public:
+    void* allocate(size_t bytes, size_t alignment) override {
+        // the default allocator uses the global operator new, which is not
+        // counted from here
+        auto const wasCounting = counting;
+        counting = false;
+        auto ptr = gbapu::defaultAllocator().allocate(bytes, alignment);
+        counting = wasCounting;
+        ++allocations;
+        live += bytes;
+        if (reinterpret_cast<uintptr_t>(ptr) % gbapu::CACHE_LINE_SIZE) {
+            ++misaligned;
+        }
+        if (bytes >= gbapu::HUGE_PAGE_SIZE && reinterpret_cast<uintptr_t>(ptr) % gbapu::HUGE_PAGE_SIZE) {
+            ++misaligned;
+        }
+        return ptr;
+    }
+
+    void deallocate(void *ptr, size_t bytes, size_t alignment) noexcept override {
+        gbapu::defaultAllocator().deallocate(ptr, bytes, alignment);
+        live -= bytes;
+    }
+
+    size_t allocations = 0;
+    size_t live = 0;
+    size_t misaligned = 0;
+
+};
+
+int failures = 0;
+
+void check(bool condition, char const* what) {
+    if (!condition) {
+        std::printf("FAIL: %s\n", what);
+        ++failures;
+    }
+}
+
+void play(gbapu::Apu &apu) {
+    apu.writeRegister(gbapu::Apu::REG_NR52, 0x80, 0);
+    apu.writeRegister(gbapu::Apu::REG_NR50, 0x77, 0);
+    apu.writeRegister(gbapu::Apu::REG_NR51, 0xFF, 0);
+    apu.writeRegister(gbapu::Apu::REG_NR12, 0xF0, 0);
+    apu.writeRegister(gbapu::Apu::REG_NR11, 0x80, 0);
+    apu.writeRegister(gbapu::Apu::REG_NR13, 0x00, 0);
+    apu.writeRegister(gbapu::Apu::REG_NR14, 0x87, 0);
+    apu.writeRegister(gbapu::Apu::REG_NR42, 0xF1, 0);
+    apu.writeRegister(gbapu::Apu::REG_NR43, 0x40, 0);
+    apu.writeRegister(gbapu::Apu::REG_NR44, 0x80, 0);
+}
+
+}
+
+void* operator new(size_t bytes) {
+    return countedAlloc(bytes, 0);
+}
+
+void* operator new(size_t bytes, std::align_val_t alignment) {
+    return countedAlloc(bytes, (size_t)alignment);
+}
+
+void operator delete(void *ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t, std::align_val_t) noexcept {
+    std::free(ptr);
+}
+
+int main() {
+    constexpr uint32_t FRAME = 70224;
+    constexpr size_t BUFFERSIZE = 1024;
+
+    TrackingAllocator allocator;
+    std::vector<float> samples(BUFFERSIZE * 2);
+    size_t flushed = 0;
+
+    {
+        counting = true;
+        gbapu::Apu apu(48000, BUFFERSIZE, allocator);
+        apu.addOutput(44100, BUFFERSIZE);
+        apu.setTaps(true);
+        apu.setSink([&flushed](size_t, float const*, size_t count) {
+            flushed += count;
+        });
+        counting = false;
+        check(globalAllocations == 0, "no global allocations while constructing and configuring");
+        check(allocator.allocations > 0, "buffers are allocated with the allocator");
+
+        auto const configured = allocator.allocations;
+        counting = true;
+        play(apu);
+        counting = false;
+        check(globalAllocations == 0, "no global allocations while writing registers");
+        check(allocator.allocations == configured, "no allocations while writing registers");
+
+        // reading every frame
+        counting = true;
+        for (int frame = 0; frame != 60; ++frame) {
+            apu.step(FRAME);
+            apu.endFrame();
+            apu.readSamples(samples.data(), BUFFERSIZE);
+            apu.readSamples(1, samples.data(), BUFFERSIZE);
+        }
+        counting = false;
+        check(globalAllocations == 0, "no global allocations while reading every frame");
+        check(allocator.allocations == configured, "no allocations while reading every frame");
+
+        // frames longer than the buffer, flushed to the sink since flush is
+        // the default policy with an allocator
+        counting = true;
+        for (int frame = 0; frame != 10; ++frame) {
+            apu.step(FRAME * 4);
+            apu.endFrame();
+            apu.readSamples(samples.data(), BUFFERSIZE);
+            apu.readSamples(1, samples.data(), BUFFERSIZE);
+        }
+        counting = false;
+        check(flushed > 0, "long frames are flushed to the sink");
+        check(globalAllocations == 0, "no global allocations while flushing");
+        check(allocator.allocations == configured, "no allocations while flushing");
+
+        // a large buffer is aligned to a huge page
+        apu.setBuffersize(gbapu::HUGE_PAGE_SIZE / sizeof(float));
+    }
+
+    {
+        gbapu::Apu host(48000, BUFFERSIZE, allocator);
+        gbapu::Apu guest(48000, BUFFERSIZE, allocator);
+        auto const before = allocator.live;
+        guest.setHost(&host);
+        check(allocator.live + (BUFFERSIZE * 2 * sizeof(float)) <= before, "a guest frees its buffer");
+
+        // settings that size the buffer do not allocate it again
+        guest.setStems(true);
+        guest.setMono(true);
+        guest.setSynthesis(gbapu::Synthesis::oversampled);
+        check(allocator.live + (BUFFERSIZE * 2 * sizeof(float)) <= before, "a guest keeps its buffer freed");
+
+        play(guest);
+        guest.step(FRAME);
+        host.step(FRAME);
+        guest.endFrame();
+        host.endFrame();
+        check(host.readSamples(samples.data(), BUFFERSIZE) > 0, "a guest mixes into its host");
+
+        guest.setHost(nullptr);
+        guest.step(FRAME);
+        guest.endFrame();
+        check(guest.readSamples(samples.data(), BUFFERSIZE) > 0, "a guest mixes into its own buffer once unset");
+    }
+    check(allocator.live == 0, "every allocation is freed");
+    check(allocator.misaligned == 0, "buffers are aligned");
+
+    if (failures == 0) {
+        std::printf("PASS\n");
+    }
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
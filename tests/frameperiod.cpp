@@ -0,0 +1,98 @@
+//
+// Checks that with a frame period set, every frame of the period yields
+// exactly samplesPerFrame() samples in each output, so that the samples of
+// N frames sum to exactly N times that, whatever the steps and writes
+// within the frames.
+//
+
+#include "gbapu.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+namespace {
+
+constexpr size_t BUFFERSIZE = 4096;
+constexpr int FRAMES = 1000;
+
+int failures = 0;
+
+void check(bool condition, char const* what, uint32_t period, int frame) {
+    if (!condition) {
+        std::printf("FAIL: %s (period %u, frame %d)\n", what, (unsigned)period, frame);
+        ++failures;
+    }
+}
+
+//
+// Steps a frame of the given period in random lengths, with random writes
+// to the channel registers in between
+//
+void playFrame(gbapu::Apu &apu, std::minstd_rand &rng, uint32_t period) {
+    static constexpr uint8_t REGS[] = {
+        0x10, 0x11, 0x12, 0x13, 0x14,
+        0x16, 0x17, 0x18, 0x19,
+        0x1A, 0x1B, 0x1C, 0x1D, 0x1E,
+        0x20, 0x21, 0x22, 0x23
+    };
+
+    uint32_t time = 0;
+    for (;;) {
+        time += rng() % (period / 4);
+        if (time >= period) {
+            break;
+        }
+        apu.stepTo(time);
+        auto const reg = REGS[rng() % (sizeof(REGS) / sizeof(REGS[0]))];
+        auto value = (uint8_t)rng();
+        if (reg == 0x14 || reg == 0x19 || reg == 0x1E || reg == 0x23) {
+            // trigger
+            value |= 0x80;
+        }
+        apu.writeRegister(reg, value, 0);
+    }
+    apu.stepTo(period);
+    apu.endFrame();
+}
+
+}
+
+int main() {
+    // a full frame, a quarter frame, and a period that is not a divisor of
+    // the clock
+    for (uint32_t period : { 70224u, 17556u, 12345u }) {
+        std::minstd_rand rng(period);
+
+        gbapu::Apu apu(48000, BUFFERSIZE);
+        apu.addOutput(44100, BUFFERSIZE);
+        apu.addOutput(22050, BUFFERSIZE);
+        apu.setFramePeriod(period);
+        apu.clearSamples();
+        apu.writeRegister(gbapu::Apu::REG_NR52, 0x80);
+        apu.writeRegister(gbapu::Apu::REG_NR50, 0x77);
+        apu.writeRegister(gbapu::Apu::REG_NR51, 0xFF);
+
+        std::vector<float> samples(BUFFERSIZE * 2);
+        std::vector<size_t> totals(apu.outputs());
+        for (int frame = 0; frame != FRAMES; ++frame) {
+            playFrame(apu, rng, period);
+            for (size_t output = 0; output != apu.outputs(); ++output) {
+                auto const count = apu.readSamples(output, samples.data(), BUFFERSIZE);
+                check(count == apu.samplesPerFrame(output), "each frame yields samplesPerFrame samples", period, frame);
+                totals[output] += count;
+            }
+        }
+
+        for (size_t output = 0; output != apu.outputs(); ++output) {
+            check(apu.samplesPerFrame(output) > 0, "samplesPerFrame is set", period, FRAMES);
+            check(totals[output] == FRAMES * apu.samplesPerFrame(output), "frames sum to exactly N times samplesPerFrame", period, FRAMES);
+        }
+    }
+
+    if (failures == 0) {
+        std::printf("PASS\n");
+    }
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
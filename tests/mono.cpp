@@ -0,0 +1,137 @@
+//
+// Checks that mono output matches stereo output. With every channel panned
+// to both terminals, each terminal equals the mono stream, and with any
+// panning the mono stream is the average of the terminals. Both are checked
+// for the main output and an additional output.
+//
+
+#include "gbapu.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+namespace {
+
+constexpr uint32_t FRAME = 70224;
+constexpr size_t BUFFERSIZE = 2048;
+
+// the folded volume steps round differently than the stereo ones
+constexpr float TOLERANCE = 3e-5f;
+
+struct Write {
+    uint32_t time;
+    uint8_t reg;
+    uint8_t value;
+};
+
+int failures = 0;
+
+void check(bool condition, char const* what, bool panning, int frame) {
+    if (!condition) {
+        std::printf("FAIL: %s (%s, frame %d)\n", what, panning ? "panned" : "centered", frame);
+        ++failures;
+    }
+}
+
+//
+// Random writes to every channel register, and to NR50 and NR51 if panning
+//
+std::vector<Write> randomFrame(std::minstd_rand &rng, bool panning) {
+    static constexpr uint8_t REGS[] = {
+        0x10, 0x11, 0x12, 0x13, 0x14,
+        0x16, 0x17, 0x18, 0x19,
+        0x1A, 0x1B, 0x1C, 0x1D, 0x1E,
+        0x20, 0x21, 0x22, 0x23,
+        0x24, 0x25
+    };
+    constexpr size_t CHANNEL_REGS = (sizeof(REGS) / sizeof(REGS[0])) - 2;
+
+    std::vector<Write> writes;
+    uint32_t time = 0;
+    for (;;) {
+        time += rng() % 20000;
+        if (time >= FRAME) {
+            break;
+        }
+        uint8_t reg;
+        if (rng() % 4 == 0) {
+            reg = (uint8_t)(gbapu::Apu::REG_WAVERAM + rng() % 16);
+        } else {
+            reg = REGS[rng() % (panning ? sizeof(REGS) / sizeof(REGS[0]) : CHANNEL_REGS)];
+        }
+        auto value = (uint8_t)rng();
+        if (reg == 0x14 || reg == 0x19 || reg == 0x1E || reg == 0x23) {
+            // trigger
+            value |= 0x80;
+        }
+        writes.push_back({ time, reg, value });
+    }
+    return writes;
+}
+
+void playFrame(gbapu::Apu &apu, std::vector<Write> const& writes) {
+    for (auto const& write : writes) {
+        apu.stepTo(write.time);
+        apu.writeRegister(write.reg, write.value, 0);
+    }
+    apu.stepTo(FRAME);
+    apu.endFrame();
+}
+
+void powerOn(gbapu::Apu &apu) {
+    apu.writeRegister(gbapu::Apu::REG_NR52, 0x80);
+    apu.writeRegister(gbapu::Apu::REG_NR50, 0x77);
+    apu.writeRegister(gbapu::Apu::REG_NR51, 0xFF);
+}
+
+}
+
+int main() {
+    for (bool panning : { false, true }) {
+        std::minstd_rand rng(11);
+
+        gbapu::Apu stereo(48000, BUFFERSIZE);
+        gbapu::Apu mono(48000, BUFFERSIZE);
+        stereo.addOutput(44100, BUFFERSIZE);
+        mono.addOutput(44100, BUFFERSIZE);
+        mono.setMono(true);
+        powerOn(stereo);
+        powerOn(mono);
+
+        std::vector<float> stereoSamples(BUFFERSIZE * 2);
+        std::vector<float> monoSamples(BUFFERSIZE);
+
+        for (int frame = 0; frame != 300; ++frame) {
+            auto const writes = randomFrame(rng, panning);
+            playFrame(stereo, writes);
+            playFrame(mono, writes);
+
+            for (size_t output = 0; output != stereo.outputs(); ++output) {
+                auto const samples = stereo.readSamples(output, stereoSamples.data(), BUFFERSIZE);
+                check(samples == mono.readSamples(output, monoSamples.data(), BUFFERSIZE), "same number of samples", panning, frame);
+
+                float terminalError = 0.0f;
+                float averageError = 0.0f;
+                for (size_t i = 0; i != samples; ++i) {
+                    auto const left = stereoSamples[i * 2];
+                    auto const right = stereoSamples[(i * 2) + 1];
+                    terminalError = std::max({ terminalError, std::abs(left - monoSamples[i]), std::abs(right - monoSamples[i]) });
+                    averageError = std::max(averageError, std::abs(((left + right) * 0.5f) - monoSamples[i]));
+                }
+                if (!panning) {
+                    check(terminalError <= TOLERANCE, "each terminal equals the mono stream", panning, frame);
+                }
+                check(averageError <= TOLERANCE, "the mono stream is the average of the terminals", panning, frame);
+            }
+        }
+    }
+
+    if (failures == 0) {
+        std::printf("PASS\n");
+    }
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,145 @@
+//
+// Checks that a channel ends in the same state whether it was mixed, muted
+// through NR51, or emulated with mixing disabled. Muted channels must have
+// the same outputs as mixed ones, and an Apu restored from the state of an
+// Apu with mixing disabled must produce the exact same samples.
+//
+
+#include "gbapu.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+namespace {
+
+constexpr uint32_t FRAME = 70224;
+constexpr size_t BUFFERSIZE = 2048;
+
+struct Write {
+    uint32_t time;
+    uint8_t reg;
+    uint8_t value;
+};
+
+int failures = 0;
+
+void check(bool condition, char const* what, int frame) {
+    if (!condition) {
+        std::printf("FAIL: %s (frame %d)\n", what, frame);
+        ++failures;
+    }
+}
+
+//
+// Random writes to every channel register, with long periods and running
+// envelopes so that outputs change between timer clocks
+//
+std::vector<Write> randomFrame(std::minstd_rand &rng) {
+    static constexpr uint8_t REGS[] = {
+        0x10, 0x11, 0x12, 0x13, 0x14,
+        0x16, 0x17, 0x18, 0x19,
+        0x1A, 0x1B, 0x1C, 0x1D, 0x1E,
+        0x20, 0x21, 0x22, 0x23,
+        0x24
+    };
+
+    std::vector<Write> writes;
+    uint32_t time = 0;
+    for (;;) {
+        time += rng() % 20000;
+        if (time >= FRAME) {
+            break;
+        }
+        uint8_t reg;
+        if (rng() % 4 == 0) {
+            reg = (uint8_t)(gbapu::Apu::REG_WAVERAM + rng() % 16);
+        } else {
+            reg = REGS[rng() % (sizeof(REGS) / sizeof(REGS[0]))];
+        }
+        auto value = (uint8_t)rng();
+        if (reg == 0x14 || reg == 0x19 || reg == 0x1E || reg == 0x23) {
+            // trigger
+            value |= 0x80;
+        }
+        writes.push_back({ time, reg, value });
+    }
+    return writes;
+}
+
+void playFrame(gbapu::Apu &apu, std::vector<Write> const& writes) {
+    for (auto const& write : writes) {
+        apu.stepTo(write.time);
+        apu.writeRegister(write.reg, write.value, 0);
+    }
+    apu.stepTo(FRAME);
+    apu.endFrame();
+}
+
+void powerOn(gbapu::Apu &apu, uint8_t nr51) {
+    apu.writeRegister(gbapu::Apu::REG_NR52, 0x80);
+    apu.writeRegister(gbapu::Apu::REG_NR50, 0x77);
+    apu.writeRegister(gbapu::Apu::REG_NR51, nr51);
+    apu.stepTo(FRAME);
+    apu.endFrame();
+}
+
+//
+// True if every channel in both states has the same output
+//
+bool sameOutputs(gbapu::Apu::State a, gbapu::Apu::State b) {
+    return a.hardware.channel<0>().output() == b.hardware.channel<0>().output() &&
+           a.hardware.channel<1>().output() == b.hardware.channel<1>().output() &&
+           a.hardware.channel<2>().output() == b.hardware.channel<2>().output() &&
+           a.hardware.channel<3>().output() == b.hardware.channel<3>().output();
+}
+
+//
+// Renders a frame from the given state
+//
+std::vector<float> renderFrom(gbapu::Apu::State const& state) {
+    gbapu::Apu apu(48000, BUFFERSIZE);
+    apu.restoreState(state);
+    apu.step(FRAME);
+    apu.endFrame();
+    std::vector<float> samples(BUFFERSIZE * 2);
+    samples.resize(apu.readSamples(samples.data(), BUFFERSIZE) * 2);
+    return samples;
+}
+
+}
+
+int main() {
+    std::minstd_rand rng(3);
+    std::vector<float> samples(BUFFERSIZE * 2);
+
+    gbapu::Apu mixed(48000, BUFFERSIZE);
+    gbapu::Apu muted(48000, BUFFERSIZE);
+    gbapu::Apu unmixed(48000, BUFFERSIZE);
+    unmixed.setMixing(false);
+    powerOn(mixed, 0xFF);
+    powerOn(muted, 0x00);
+    powerOn(unmixed, 0xFF);
+
+    for (int frame = 0; frame != 300; ++frame) {
+        auto const writes = randomFrame(rng);
+        playFrame(mixed, writes);
+        playFrame(muted, writes);
+        playFrame(unmixed, writes);
+        mixed.readSamples(samples.data(), BUFFERSIZE);
+        muted.readSamples(samples.data(), BUFFERSIZE);
+
+        auto const state = mixed.saveState();
+        check(sameOutputs(state, muted.saveState()), "muted channels have the mixed outputs", frame);
+        auto const expected = renderFrom(state);
+        check(!expected.empty(), "samples are rendered", frame);
+        check(renderFrom(unmixed.saveState()) == expected, "unmixed channels end in the mixed state", frame);
+    }
+
+    if (failures == 0) {
+        std::printf("PASS\n");
+    }
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
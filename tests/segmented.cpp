@@ -0,0 +1,94 @@
+//
+// Checks that Renderer::renderSegmented is bit-exact with Renderer::render,
+// for segment lengths that do and do not divide the render, and for any
+// number of threads.
+//
+
+#include "gbapu_render.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+namespace {
+
+int failures = 0;
+
+void check(bool condition, char const* what, unsigned threads, size_t frames) {
+    if (!condition) {
+        std::printf("FAIL: %s (%u threads, %zu frames per segment)\n", what, threads, frames);
+        ++failures;
+    }
+}
+
+//
+// Random writes to every channel register over the given number of frames,
+// including wave RAM and panning
+//
+std::vector<gbapu::RegisterWrite> randomScript(uint64_t duration) {
+    static constexpr uint8_t REGS[] = {
+        0x10, 0x11, 0x12, 0x13, 0x14,
+        0x16, 0x17, 0x18, 0x19,
+        0x1A, 0x1B, 0x1C, 0x1D, 0x1E,
+        0x20, 0x21, 0x22, 0x23,
+        0x24, 0x25
+    };
+
+    std::minstd_rand rng(5);
+    std::vector<gbapu::RegisterWrite> script;
+    uint64_t time = 0;
+    script.push_back({ time, 0x26, 0x80 });
+    script.push_back({ time += 12, 0x24, 0x77 });
+    script.push_back({ time += 12, 0x25, 0xFF });
+    for (uint8_t i = 0; i != 16; ++i) {
+        script.push_back({ time += 12, (uint8_t)(0x30 + i), (uint8_t)rng() });
+    }
+    for (;;) {
+        time += rng() % 200000;
+        if (time >= duration) {
+            break;
+        }
+        auto const reg = REGS[rng() % (sizeof(REGS) / sizeof(REGS[0]))];
+        auto value = (uint8_t)rng();
+        if (reg == 0x14 || reg == 0x19 || reg == 0x1E || reg == 0x23) {
+            // trigger
+            value |= 0x80;
+        }
+        script.push_back({ time, reg, value });
+    }
+    return script;
+}
+
+}
+
+int main() {
+    // not a whole number of frames
+    constexpr uint64_t DURATION = (600ull * gbapu::Renderer::CYCLES_PER_FRAME) - 1234;
+
+    std::vector<float> expected;
+    gbapu::RenderJob job{ randomScript(DURATION), DURATION, [&expected](float const* samples, size_t count) {
+        expected.insert(expected.end(), samples, samples + (count * 2));
+    }};
+    gbapu::Renderer serial(48000, 1);
+    serial.render({ job });
+    check(!expected.empty(), "render produces samples", 1, 0);
+
+    for (unsigned threads : { 1u, 3u }) {
+        gbapu::Renderer renderer(48000, threads);
+        for (size_t frames : { (size_t)1, (size_t)7, (size_t)100, (size_t)600, (size_t)1000 }) {
+            std::vector<float> samples;
+            job.sink = [&samples](float const* buf, size_t count) {
+                samples.insert(samples.end(), buf, buf + (count * 2));
+            };
+            renderer.renderSegmented(job, frames);
+            check(samples.size() == expected.size(), "same number of samples", threads, frames);
+            check(samples == expected, "same samples", threads, frames);
+        }
+    }
+
+    if (failures == 0) {
+        std::printf("PASS\n");
+    }
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,131 @@
+//
+// Checks that the stems read with readStems sum to the output read along
+// with them, and to the output of an Apu without stems.
+//
+
+#include "gbapu.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+namespace {
+
+constexpr uint32_t FRAME = 70224;
+constexpr size_t BUFFERSIZE = 2048;
+
+// filtering each stem separately rounds differently than filtering the sum
+constexpr float TOLERANCE = 1e-5f;
+
+struct Write {
+    uint32_t time;
+    uint8_t reg;
+    uint8_t value;
+};
+
+int failures = 0;
+
+void check(bool condition, char const* what, int frame) {
+    if (!condition) {
+        std::printf("FAIL: %s (frame %d)\n", what, frame);
+        ++failures;
+    }
+}
+
+//
+// Random writes to every channel register, including panning
+//
+std::vector<Write> randomFrame(std::minstd_rand &rng) {
+    static constexpr uint8_t REGS[] = {
+        0x10, 0x11, 0x12, 0x13, 0x14,
+        0x16, 0x17, 0x18, 0x19,
+        0x1A, 0x1B, 0x1C, 0x1D, 0x1E,
+        0x20, 0x21, 0x22, 0x23,
+        0x24, 0x25
+    };
+
+    std::vector<Write> writes;
+    uint32_t time = 0;
+    for (;;) {
+        time += rng() % 20000;
+        if (time >= FRAME) {
+            break;
+        }
+        uint8_t reg;
+        if (rng() % 4 == 0) {
+            reg = (uint8_t)(gbapu::Apu::REG_WAVERAM + rng() % 16);
+        } else {
+            reg = REGS[rng() % (sizeof(REGS) / sizeof(REGS[0]))];
+        }
+        auto value = (uint8_t)rng();
+        if (reg == 0x14 || reg == 0x19 || reg == 0x1E || reg == 0x23) {
+            // trigger
+            value |= 0x80;
+        }
+        writes.push_back({ time, reg, value });
+    }
+    return writes;
+}
+
+void playFrame(gbapu::Apu &apu, std::vector<Write> const& writes) {
+    for (auto const& write : writes) {
+        apu.stepTo(write.time);
+        apu.writeRegister(write.reg, write.value, 0);
+    }
+    apu.stepTo(FRAME);
+    apu.endFrame();
+}
+
+void powerOn(gbapu::Apu &apu) {
+    apu.writeRegister(gbapu::Apu::REG_NR52, 0x80);
+    apu.writeRegister(gbapu::Apu::REG_NR50, 0x77);
+    apu.writeRegister(gbapu::Apu::REG_NR51, 0xFF);
+}
+
+}
+
+int main() {
+    for (auto synthesis : { gbapu::Synthesis::blep, gbapu::Synthesis::linear, gbapu::Synthesis::nearest, gbapu::Synthesis::oversampled }) {
+        std::minstd_rand rng(7);
+
+        gbapu::Apu apu(48000, BUFFERSIZE);
+        gbapu::Apu reference(48000, BUFFERSIZE);
+        apu.setSynthesis(synthesis);
+        reference.setSynthesis(synthesis);
+        apu.setStems(true);
+        powerOn(apu);
+        powerOn(reference);
+
+        std::vector<float> mixed(BUFFERSIZE * 2);
+        std::vector<float> expected(BUFFERSIZE * 2);
+        std::vector<std::vector<float>> stems(4, std::vector<float>(BUFFERSIZE * 2));
+
+        for (int frame = 0; frame != 300; ++frame) {
+            auto const writes = randomFrame(rng);
+            playFrame(apu, writes);
+            playFrame(reference, writes);
+
+            auto const samples = apu.readStems(mixed.data(), { stems[0].data(), stems[1].data(), stems[2].data(), stems[3].data() }, BUFFERSIZE);
+            check(samples == reference.readSamples(expected.data(), BUFFERSIZE), "same number of samples", frame);
+
+            bool sum = true;
+            float error = 0.0f;
+            for (size_t i = 0; i != samples * 2; ++i) {
+                // summed in channel order, like the mixed output
+                auto const stemSum = ((stems[0][i] + stems[1][i]) + stems[2][i]) + stems[3][i];
+                sum = sum && stemSum == mixed[i];
+                error = std::max(error, std::abs(mixed[i] - expected[i]));
+            }
+            check(sum, "stems sum to the output read with them", frame);
+            check(error <= TOLERANCE, "stems sum to the output without stems", frame);
+        }
+    }
+
+    if (failures == 0) {
+        std::printf("PASS\n");
+    }
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}